@@ -6,31 +6,106 @@
  * This program demonstrates a task-based parallelization strategy.
  * The image is initially tiled in patches, dispatched to threads.
  * Every thread evaluate the Mandelbrot kernel on the border of the patch:
- * - If the border is entirely within the set, the whole patch is colored as such (value 0)
- * - If the border is entirely outside the set, the patch is colored with the
- * average iteration count of the border points.
- * - If the border is mixed, the patch is split into four sub-patches,
+ * - If all the points of the border have the same iteration count (0 when
+ * they are all within the set), the inside of the patch is filled with it:
+ * the points with the same escape count form connected bands, so that a
+ * border of a single count encloses no other one (Mariani-Silver).
+ * - Otherwise the border is mixed, the patch is split into four sub-patches,
  * and new OpenMP tasks are generated to handle them.
  *
  * This approach minimizes computation in the large, uniform areas of the set.
- * The core calculation loop tries to be friendly to compiler auto-vectorization.
+ * The border points are written in the image with their exact value, and
+ * the half of the border of a sub-patch that lies on its parent's border
+ * is taken from the image instead of being evaluated again; only the
+ * inside of a uniform patch is filled.
+ *
+ * The escape loop of a single point is data-dependent and does not
+ * vectorize; the points are therefore evaluated in batches (the border of
+ * a patch, a whole small patch) by escape_batch(), that iterates 4 (AVX2)
+ * or 8 (AVX-512) points per vector: every lane carries an escape mask and
+ * its own counter, and the loop stops when all the lanes have escaped. The
+ * kernels are compiled with the target attribute and chosen at run-time;
+ * the environment variable MANDELBROT_ISA=avx512|avx2|scalar forces one.
+ * All of them perform the same operations; whether the compiler fuses a
+ * multiply and an add into an FMA (-march, -ffp-contract) changes the
+ * escape count of a few points on the boundary, so compare the kernels
+ * with the same flags (with -march=native they give the same image).
+ *
+ * Not every sub-patch is worth a task: a task costs its creation and its
+ * scheduling, and near the boundary of the set the recursion goes down to
+ * millions of tiny patches. The work of a sub-patch is estimated from its
+ * parent's border, as (average iterations per border point) x (pixels),
+ * the points in the set counting max_iter each. Sub-patches estimated
+ * below task_cutoff iterations are computed inline by the thread that found
+ * them; only the first max_task_depth levels of recursion create tasks,
+ * the last ones final, so that all of their descendants are computed
+ * inline as well.
+ * The number of tasks created, of patches computed inline and the busy time
+ * of every thread are reported, to tune the two parameters.
+ *
+ * What is rendered (resolution, viewport in the complex plane, maximum
+ * number of iterations) is described by a render context, render_t, that
+ * is passed down to the kernels; it also holds the coordinates of every
+ * column and of every row, computed once, so that no point needs a
+ * division to find where it is.
  *
  *
  * Recommended compilation for performance:
- * gcc -O3 -fopenmp -march=native -mtune -ftree-vectorize -o mandelbrot_tasks mandelbrot_omp_tasks.c -lm
+ * gcc -O3 -fopenmp -march=native -mtune -ftree-vectorize -o mandelbrot_tasks mandelbrot_omp_tasks.c -lm -lz
+ * (with -DNO_ZLIB, and without -lz, the PNG is written by stb_image_write only at the end)
  *
  * COMMAND-LINE arguments:
  *
- * ./mandelbrot_tasks x_size y_size max_iteration initial_patch_size
+ * ./mandelbrot_tasks [-v x_min,x_max,y_min,y_max | -z re,im,radius] [-p] [-o file] [-b rows]
+ *                    [-e tasks|taskloop[,grainsize]|steal] [-a frames[,zoom]]
+ *                    x_size y_size max_iteration initial_patch_size
+ *                    [task_cutoff [max_task_depth]]
+ *
+ *   -v              the viewport in the complex plane (default -2,1,-1.7,1.3)
+ *   -z              deep zoom around re + i im (read with ~32 digits), with
+ *                   the given half width: perturbation on a reference orbit
+ *   -p              fast path for the points in the set: cardioid and bulb
+ *                   test, and periodicity checking
+ *   -o              the output file (default mandelbrot.png); a name ending
+ *                   in .ppm gives a binary PPM
+ *   -e              the execution engine: tasks (default), taskloop[,grainsize]
+ *                   or steal (work stealing), see "the execution engines"
+ *   -b              tiled mode: the image is rendered and written in bands of
+ *                   this many rows (a multiple of the patch size), and only
+ *                   one band is in memory; by default the whole image
+ *   -a              zoom animation: this many frames, the viewport shrinking
+ *                   by zoom (default 0.9) at every frame; the output name
+ *                   needs a %d for the frame number (default
+ *                   mandelbrot_%04d.png), see "zoom animation"
+ *   task_cutoff     estimated iterations below which a sub-patch is not a
+ *                   task (default TASK_CUTOFF_DFLT, 0 = always a task)
+ *   max_task_depth  levels of recursion that can create tasks
+ *                   (default TASK_DEPTH_DFLT)
  *
- * The coed will save the Mandelbrot set in an image file named "mandelbrot.ppm".
+ * The sizes must be multiples of the initial patch size, a power of 2.
+ *
+ * The code will save the Mandelbrot set in an image file named "mandelbrot.png";
+ * the bands of rows of the PNG are compressed in parallel and written while
+ * the rest of the image is being computed. The throughput and the peak
+ * resident memory are reported.
  ·················································································
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <omp.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SIMD_KERNELS
+#endif
+
+#if !defined(NO_ZLIB)
+#include <zlib.h>
+#endif
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -38,11 +113,13 @@
 //
 #define XSIZE_DFLT 4096
 #define YSIZE_DFLT 4096
-#define MAX_ITER 1000
+#define MAX_ITER 1000                       // default maximum number of iterations
 #define PATCH_SIDE_DEFAULT (XSIZE_DFLT / 32 ) // Default side length for the initial patches
+#define TASK_CUTOFF_DFLT (1L << 16)         // estimated iterations below which no task is created
+#define TASK_DEPTH_DFLT  8                  // recursion levels below the initial patches with tasks
 
 
-// --- Mandelbrot Set Boundaries in the Complex Plane ---
+// --- default Mandelbrot Set Boundaries in the Complex Plane ---
 // 
 const double X_MIN = -2.0;
 const double X_MAX = 1.0;
@@ -52,15 +129,16 @@ const double Y_MAX = 1.3;
 /**
  * @brief The core kernel. Determines if a point c = (cx, cy) is in the set.
  * @return The number of iterations to escape, or 0 if it's in the set.
- * This function is a prime candidate for SIMD/vectorization.
+ * Its loop is data-dependent and does not vectorize: batches of points go
+ * through escape_batch() instead, this is the reference for a single point.
  */
-static inline int mandelbrot_point(double cx, double cy)
+static inline int mandelbrot_point(double cx, double cy, int max_iter)
 {
   double zx = 0.0, zy = 0.0;
   double zx_sq = 0.0, zy_sq = 0.0;
   int iter = 0;
 
-    while (iter < MAX_ITER && zx_sq + zy_sq <= 4.0)
+    while (iter < max_iter && zx_sq + zy_sq <= 4.0)
       {
         zy = 2.0 * zx * zy + cy;
         zx = zx_sq - zy_sq + cx;
@@ -69,229 +147,2109 @@ static inline int mandelbrot_point(double cx, double cy)
         iter++;
       }
 
-    return (iter == MAX_ITER) ? 0 : iter;
+    return (iter == max_iter) ? 0 : iter;
 }
 
-// Forward declaration for the recursive function
-void compute_patch(int* image, int x_start, int y_start, int xsize, int ysize, int size);
+
+/*
+ * The fast path for the points in the set, which otherwise run all the
+ * max_iter iterations:
+ *
+ * - the main cardioid and the period-2 bulb are known analytically,
+ *      q (q + x - 1/4) <= y^2 / 4,  q = (x - 1/4)^2 + y^2
+ *      (x + 1)^2 + y^2 <= 1/16
+ *   and their points are not iterated at all;
+ * - the orbit of the other points in the set falls into a cycle. Brent's
+ *   method compares z with a saved value, that is refreshed at iterations
+ *   8, 16, 32, ...: once the power of two exceeds the length of the cycle,
+ *   z meets the saved value again.
+ *
+ * z is compared exactly: the iteration is deterministic, so an orbit that
+ * comes back to a value it already had repeats forever and never escapes.
+ * A point is then never classified differently than by mandelbrot_point(),
+ * and the image is the same; an orbit that only converges to its cycle
+ * within the round-off is caught later, or not at all.
+ */
+#define PERIOD_CHECK_START 8
+
+static inline bool in_cardioid_or_bulb ( double cx, double cy )
+{
+  double xq = cx - 0.25;
+  double y2 = cy * cy;
+  double q  = xq * xq + y2;
+  return ( q * (q + xq) <= 0.25 * y2 ) || ( (cx + 1.0) * (cx + 1.0) + y2 <= 0.0625 );
+}
 
 /**
- * @brief Main recursive function to compute a patch of the Mandelbrot set.
+ * @brief mandelbrot_point() with the fast path.
+ * @param saved  incremented by the number of iterations skipped
  */
-void compute_patch(int* image, int x_start, int y_start, int xsize, int ysize, int size)
+static inline int mandelbrot_point_check(double cx, double cy, int max_iter, long *saved)
 {
-    bool all_in = true;
-    bool all_out = true;
-    long total_border_iter = 0;
-    int border_points = 0;
+  if ( in_cardioid_or_bulb( cx, cy ) ) {
+    *saved += max_iter;
+    return 0; }
 
-    // 1. Check the border of the patch
-    for (int i = 0; i < size; i++)
-      {
-	
-        // Top and Bottom borders
-        int p_top = mandelbrot_point(X_MIN + (x_start + i) * (X_MAX - X_MIN) / xsize,
-				     Y_MIN + y_start * (Y_MAX - Y_MIN) / ysize);
-	
-        int p_bot = mandelbrot_point(X_MIN + (x_start + i) * (X_MAX - X_MIN) / xsize,
-				     Y_MIN + (y_start + size - 1) * (Y_MAX - Y_MIN) / ysize);
-	
-	
-        // Left and Right borders (excluding corners already checked)
-        int p_left = (i > 0 && i < size - 1) ?
-	  mandelbrot_point(X_MIN + x_start * (X_MAX - X_MIN) / xsize,
-			   Y_MIN + (y_start + i) * (Y_MAX - Y_MIN) / ysize) : -1;
-	
-        int p_right = (i > 0 && i < size - 1) ?
-	  mandelbrot_point(X_MIN + (x_start + size - 1) * (X_MAX - X_MIN) / xsize,
-			   Y_MIN + (y_start + i) * (Y_MAX - Y_MIN) / ysize) : -1;
-
-        int border_values[] = {p_top, p_bot, p_left, p_right};
-	
-        for(int j = 0; j < 4; ++j)
-	  {
-            if (border_values[j] != -1)
-	      {
-                if (border_values[j] == 0) all_out = false;
-                else all_in = false;
-                total_border_iter += border_values[j];
-                border_points++;
-	      }
-	  }
-      }
+  double zx = 0.0, zy = 0.0;
+  double zx_sq = 0.0, zy_sq = 0.0;
+  double sx = 0.0, sy = 0.0;
+  int iter = 0;
+  int next_save = PERIOD_CHECK_START;
 
-    // 2. evaluate the border
-    if (all_in)
-      {
-        // Fill the entire patch with 0 (inside the set)
-        for (int y = y_start; y < y_start + size; y++)
-	  {
-            for (int x = x_start; x < x_start + size; x++)
-	      image[y * xsize + x] = 0;
-	  }
-      } else if (all_out)
-      {
-        // Fill the entire patch with the average border iteration
-        int avg_iter = border_points > 0 ? (int)(total_border_iter / border_points) : 1;
-        if (avg_iter == 0) avg_iter = 1; // Ensure it's not colored as "in the set"
-        for (int y = y_start; y < y_start + size; y++)
-	  {
-            for (int x = x_start; x < x_start + size; x++)
-                image[y * xsize + x] = avg_iter;
-	  }
-      } else
+    while (iter < max_iter && zx_sq + zy_sq <= 4.0)
       {
-        // 3. Mixed border: subdivide or compute directly
-        if (size <= 8)
-	  { //If patch is small, compute all points
-            for (int y = y_start; y < y_start + size; y++)
-	      for (int x = x_start; x < x_start + size; x++)
-		image[y * xsize + x] = mandelbrot_point(X_MIN + x * (X_MAX - X_MIN) / xsize,
-							Y_MIN + y * (Y_MAX - Y_MIN) / ysize );
-	  }
-	else
-	  {
-            // Recursive step: split into 4 sub-patches and create tasks
-	    int new_size = size / 2;
-	   #pragma omp task
-            compute_patch(image, x_start, y_start, xsize, ysize, new_size);
-	   #pragma omp task
-            compute_patch(image, x_start + new_size, y_start, xsize, ysize, new_size);
-	   #pragma omp task
-            compute_patch(image, x_start, y_start + new_size, xsize, ysize, new_size);
-	   #pragma omp task
-            compute_patch(image, x_start + new_size, y_start + new_size, xsize, ysize, new_size);
-	  }
+        zy = 2.0 * zx * zy + cy;
+        zx = zx_sq - zy_sq + cx;
+        zx_sq = zx * zx;
+        zy_sq = zy * zy;
+        iter++;
+	if ( (zx == sx) && (zy == sy) ) {
+	  *saved += max_iter - iter;
+	  return 0; }
+	if ( iter == next_save ) {
+	  sx = zx;
+	  sy = zy;
+	  next_save *= 2; }
       }
 
-    return;
+    return (iter == max_iter) ? 0 : iter;
 }
 
-/**
- * @brief Saves the image data to a PNG file using stb_image_write.
- * @param image Pointer to the raw iteration data.
- * @param filename The name of the output file.
+
+// --- batches of points
+//
+#define BATCH 64                            // points evaluated together
+
+/*
+ * A batch kernel evaluates n points, with the fast path if check, and
+ * returns the number of iterations the fast path has saved (the deep zoom
+ * kernels return the rebases instead). check is a
+ * constant in every wrapper, so that the compiler generates the loop
+ * without it for the plain kernels.
  */
-void save_to_png(int* image, int xsize, int ysize, const char* filename)
+typedef long (batch_kernel_t)( const double *, const double *, int, int, int * );
+
+static inline long escape_scalar_body ( const double *cx, const double *cy, int n, int max_iter, int *iter,
+					const bool check )
 {
-    // PNG needs a buffer of unsigned char in RGB format (3 bytes per pixel).
-  int num_pixels = xsize * ysize;
-  unsigned char* pixel_data = (unsigned char*)malloc(num_pixels * 3 * sizeof(unsigned char));
-  if (!pixel_data) {
-    perror("Failed to allocate pixel buffer for PNG");
-    return;
-  }
-  
-  // Convert iteration counts to colors, mapping each pixel to 3 bytes (R, G, B)
- #pragma omp parallel for
-  for (int i = 0; i < num_pixels; i++)
+  long saved = 0;
+  for ( int k = 0; k < n; k++ )
+    iter[k] = ( check ? mandelbrot_point_check( cx[k], cy[k], max_iter, &saved ) :
+		mandelbrot_point( cx[k], cy[k], max_iter ) );
+  return saved;
+}
+
+static long escape_scalar ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_scalar_body( cx, cy, n, max_iter, iter, false ); }
+
+static long escape_scalar_check ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_scalar_body( cx, cy, n, max_iter, iter, true ); }
+
+#if defined(HAVE_SIMD_KERNELS)
+
+/*
+ * The lanes go on iterating after they escape, the mask only stops their
+ * counters; z of an escaped lane grows to inf or nan, which compares as
+ * "escaped" again, so the mask never turns back on. The operations are the
+ * same, in the same order, as in mandelbrot_point().
+ * With the fast path, the lanes in the cardioid or in the bulb, and those
+ * whose orbit meets the saved z, are switched off with their counter set
+ * to max_iter, i.e. in the set. The refresh of the saved z happens at the
+ * same iteration for all the lanes.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline long escape_avx2_body ( const double *cx, const double *cy, int n, int max_iter, int *iter,
+				      const bool check )
+{
+  const __m256d four = _mm256_set1_pd( 4.0 );
+  const __m256d two  = _mm256_set1_pd( 2.0 );
+  long saved = 0;
+
+  for ( int k = 0; k < n; k += 4 )
     {
-      int iter = image[i];
-      if (iter == 0)
+      // the last vector is padded with the last point, the padding lanes
+      // being off from the start
+      double px[4], py[4];
+      long long valid[4];
+      for ( int l = 0; l < 4; l++ ) {
+	px[l] = cx[ k+l < n ? k+l : n-1 ];
+	py[l] = cy[ k+l < n ? k+l : n-1 ];
+	valid[l] = ( k+l < n ? -1 : 0 ); }
+
+      const __m256d vcx = _mm256_loadu_pd( px );
+      const __m256d vcy = _mm256_loadu_pd( py );
+      __m256d zx = _mm256_setzero_pd(), zy = _mm256_setzero_pd();
+      __m256d zx_sq = zx, zy_sq = zy;
+      __m256d sx = zx, sy = zy;
+      __m256i count = _mm256_setzero_si256();
+      __m256d active = _mm256_castsi256_pd( _mm256_loadu_si256( (const __m256i*)valid ) );
+      const __m256i vmax = _mm256_set1_epi64x( max_iter );
+      int next_save = PERIOD_CHECK_START;
+
+      if ( check )
 	{
-	  pixel_data[i * 3 + 0] = 0;   // R
-	  pixel_data[i * 3 + 1] = 0;   // G
-	  pixel_data[i * 3 + 2] = 0;   // B (Black)
+	  const __m256d quarter = _mm256_set1_pd( 0.25 );
+	  const __m256d one     = _mm256_set1_pd( 1.0 );
+	  __m256d xq = _mm256_sub_pd( vcx, quarter );
+	  __m256d y2 = _mm256_mul_pd( vcy, vcy );
+	  __m256d q  = _mm256_add_pd( _mm256_mul_pd( xq, xq ), y2 );
+	  __m256d xp = _mm256_add_pd( vcx, one );
+	  __m256d in = _mm256_or_pd(
+	    _mm256_cmp_pd( _mm256_mul_pd( q, _mm256_add_pd( q, xq ) ), _mm256_mul_pd( quarter, y2 ), _CMP_LE_OQ ),
+	    _mm256_cmp_pd( _mm256_add_pd( _mm256_mul_pd( xp, xp ), y2 ), _mm256_set1_pd( 0.0625 ), _CMP_LE_OQ ) );
+	  in     = _mm256_and_pd( in, active );
+	  count  = _mm256_castpd_si256( _mm256_blendv_pd( _mm256_castsi256_pd( count ), _mm256_castsi256_pd( vmax ), in ) );
+	  active = _mm256_andnot_pd( in, active );
+	  saved += (long)__builtin_popcount( _mm256_movemask_pd( in ) ) * max_iter;
 	}
-      else
+
+      for ( int it = 0; it < max_iter; it++ )
 	{
-	  // Simple coloring scheme
-	  pixel_data[i * 3 + 0] = (iter % 256);         // R
-	  pixel_data[i * 3 + 1] = (iter * 2 % 256);     // G
-	  pixel_data[i * 3 + 2] = (iter * 5 % 256);     // B
+	  active = _mm256_and_pd( active, _mm256_cmp_pd( _mm256_add_pd( zx_sq, zy_sq ), four, _CMP_LE_OQ ) );
+	  if ( _mm256_testz_pd( active, active ) )
+	    break;
+	  zy    = _mm256_add_pd( _mm256_mul_pd( _mm256_mul_pd( two, zx ), zy ), vcy );
+	  zx    = _mm256_add_pd( _mm256_sub_pd( zx_sq, zy_sq ), vcx );
+	  zx_sq = _mm256_mul_pd( zx, zx );
+	  zy_sq = _mm256_mul_pd( zy, zy );
+	  // active lanes are all ones, i.e. -1
+	  count = _mm256_sub_epi64( count, _mm256_castpd_si256( active ) );
+
+	  if ( check )
+	    {
+	      __m256d cycle = _mm256_and_pd( active, _mm256_and_pd( _mm256_cmp_pd( zx, sx, _CMP_EQ_OQ ),
+								  _mm256_cmp_pd( zy, sy, _CMP_EQ_OQ ) ) );
+	      int found = _mm256_movemask_pd( cycle );
+	      if ( found ) {
+		count  = _mm256_castpd_si256( _mm256_blendv_pd( _mm256_castsi256_pd( count ), _mm256_castsi256_pd( vmax ), cycle ) );
+		active = _mm256_andnot_pd( cycle, active );
+		saved += (long)__builtin_popcount( found ) * (max_iter - it - 1); }
+	      if ( it + 1 == next_save ) {
+		sx = zx;
+		sy = zy;
+		next_save *= 2; }
+	    }
 	}
+
+      long long c[4];
+      _mm256_storeu_si256( (__m256i*)c, count );
+      for ( int l = 0; (l < 4) && (k+l < n); l++ )
+	iter[k+l] = ( c[l] == max_iter ? 0 : (int)c[l] );
     }
-  
-  // Write the PNG file.
-  // stbi_write_png arguments: filename, width, height, channels, data, stride.
-  // Stride is the number of bytes per row (width * channels).
-  if (!stbi_write_png(filename, xsize, ysize, 3, pixel_data, XSIZE_DFLT * 3)) {
-    fprintf(stderr, "ERROR: could not write PNG file %s\n", filename);
-  }
-  
-  free(pixel_data);
+  return saved;
+}
+
+__attribute__((target("avx2")))
+static long escape_avx2 ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_avx2_body( cx, cy, n, max_iter, iter, false ); }
+
+__attribute__((target("avx2")))
+static long escape_avx2_check ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_avx2_body( cx, cy, n, max_iter, iter, true ); }
+
+
+__attribute__((target("avx512f"), always_inline))
+static inline long escape_avx512_body ( const double *cx, const double *cy, int n, int max_iter, int *iter,
+					const bool check )
+{
+  const __m512d four = _mm512_set1_pd( 4.0 );
+  const __m512d two  = _mm512_set1_pd( 2.0 );
+  const __m512i one  = _mm512_set1_epi64( 1 );
+  const __m512i vmax = _mm512_set1_epi64( max_iter );
+  long saved = 0;
+
+  for ( int k = 0; k < n; k += 8 )
+    {
+      // the lanes beyond n are masked out from the start
+      __mmask8 active = ( n - k >= 8 ? 0xff : (__mmask8)((1u << (n - k)) - 1) );
+
+      const __m512d vcx = _mm512_maskz_loadu_pd( active, cx + k );
+      const __m512d vcy = _mm512_maskz_loadu_pd( active, cy + k );
+      __m512d zx = _mm512_setzero_pd(), zy = _mm512_setzero_pd();
+      __m512d zx_sq = zx, zy_sq = zy;
+      __m512d sx = zx, sy = zy;
+      __m512i count = _mm512_setzero_si512();
+      int next_save = PERIOD_CHECK_START;
+
+      if ( check )
+	{
+	  const __m512d quarter = _mm512_set1_pd( 0.25 );
+	  __m512d xq = _mm512_sub_pd( vcx, quarter );
+	  __m512d y2 = _mm512_mul_pd( vcy, vcy );
+	  __m512d q  = _mm512_add_pd( _mm512_mul_pd( xq, xq ), y2 );
+	  __m512d xp = _mm512_add_pd( vcx, _mm512_set1_pd( 1.0 ) );
+	  __mmask8 in =
+	    _mm512_mask_cmp_pd_mask( active, _mm512_mul_pd( q, _mm512_add_pd( q, xq ) ), _mm512_mul_pd( quarter, y2 ), _CMP_LE_OQ ) |
+	    _mm512_mask_cmp_pd_mask( active, _mm512_add_pd( _mm512_mul_pd( xp, xp ), y2 ), _mm512_set1_pd( 0.0625 ), _CMP_LE_OQ );
+	  count   = _mm512_mask_mov_epi64( count, in, vmax );
+	  active &= ~in;
+	  saved  += (long)__builtin_popcount( in ) * max_iter;
+	}
+
+      for ( int it = 0; it < max_iter; it++ )
+	{
+	  active = _mm512_mask_cmp_pd_mask( active, _mm512_add_pd( zx_sq, zy_sq ), four, _CMP_LE_OQ );
+	  if ( active == 0 )
+	    break;
+	  zy    = _mm512_add_pd( _mm512_mul_pd( _mm512_mul_pd( two, zx ), zy ), vcy );
+	  zx    = _mm512_add_pd( _mm512_sub_pd( zx_sq, zy_sq ), vcx );
+	  zx_sq = _mm512_mul_pd( zx, zx );
+	  zy_sq = _mm512_mul_pd( zy, zy );
+	  count = _mm512_mask_add_epi64( count, active, count, one );
+
+	  if ( check )
+	    {
+	      __mmask8 cycle = _mm512_mask_cmp_pd_mask( active, zx, sx, _CMP_EQ_OQ ) &
+		               _mm512_mask_cmp_pd_mask( active, zy, sy, _CMP_EQ_OQ );
+	      if ( cycle ) {
+		count   = _mm512_mask_mov_epi64( count, cycle, vmax );
+		active &= ~cycle;
+		saved  += (long)__builtin_popcount( cycle ) * (max_iter - it - 1); }
+	      if ( it + 1 == next_save ) {
+		sx = zx;
+		sy = zy;
+		next_save *= 2; }
+	    }
+	}
+
+      long long c[8];
+      _mm512_storeu_si512( c, count );
+      for ( int l = 0; (l < 8) && (k+l < n); l++ )
+	iter[k+l] = ( c[l] == max_iter ? 0 : (int)c[l] );
+    }
+  return saved;
+}
+
+__attribute__((target("avx512f")))
+static long escape_avx512 ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_avx512_body( cx, cy, n, max_iter, iter, false ); }
+
+__attribute__((target("avx512f")))
+static long escape_avx512_check ( const double *cx, const double *cy, int n, int max_iter, int *iter )
+{ return escape_avx512_body( cx, cy, n, max_iter, iter, true ); }
+
+#endif
+
+
+// --- deep zoom: perturbation
+//
+// Past a zoom of about 1e-13 the pixels are closer to each other than the
+// resolution of a double around their coordinates. In deep zoom the orbit
+// of one point, the reference C at the centre of the image, is computed in
+// double-double (about 32 digits), and every pixel c = C + dc follows its
+// difference d_n = z_n - Z_n from the reference orbit,
+//
+//      d_{n+1} = 2 Z_n d_n + d_n^2 + dc
+//
+// that only needs doubles, since d and dc are small and Z_n, which is
+// bounded by 2, can be rounded to a double. R->cx and R->cy then hold dc,
+// not c, and compute_patch() is the same.
+// The difference d loses its precision when z = Z + d gets smaller than d
+// itself (a "glitch": the pixel and the reference went apart), and it can
+// not go on when the reference orbit ends (it escaped, or max_iter). In
+// both cases the pixel is rebased: z becomes its difference from the
+// start of the reference orbit, Z_0 = 0, and it goes on from there. The
+// rebases are counted.
+// dc must stay representable: the zoom ends at the precision of the
+// reference, 1e-30 or so.
+
+typedef struct { double hi, lo; } dd_t;
+
+static inline dd_t dd_two_sum ( double a, double b )
+{
+  double s = a + b;
+  double v = s - a;
+  return (dd_t){ s, (a - (s - v)) + (b - v) };
+}
+
+static inline dd_t dd_add ( dd_t a, dd_t b )
+{
+  dd_t s = dd_two_sum( a.hi, b.hi );
+  dd_t t = dd_two_sum( a.lo, b.lo );
+  s.lo += t.hi;
+  s = dd_two_sum( s.hi, s.lo );
+  s.lo += t.lo;
+  return dd_two_sum( s.hi, s.lo );
+}
+
+static inline dd_t dd_mul ( dd_t a, dd_t b )
+{
+  double p = a.hi * b.hi;
+  double e = fma( a.hi, b.hi, -p );
+  e += a.hi * b.lo + a.lo * b.hi;
+  return dd_two_sum( p, e );
+}
+
+static inline dd_t dd_div ( dd_t a, dd_t b )
+{
+  double q1 = a.hi / b.hi;
+  dd_t   r  = dd_add( a, dd_mul( (dd_t){ -q1, 0 }, b ) );
+  double q2 = r.hi / b.hi;
+  r = dd_add( r, dd_mul( (dd_t){ -q2, 0 }, b ) );
+  double q3 = r.hi / b.hi;
+  return dd_add( dd_two_sum( q1, q2 ), (dd_t){ q3, 0 } );
 }
 
 /**
- * @brief Saves the image data to a PPM file.
+ * @brief Reads a decimal number, like strtod(), in double-double.
+ * @return the position after the number, or s if there is none
  */
-void save_to_ppm(int* image, int xsize, int ysize, const char* filename)
+const char *dd_parse ( const char *s, dd_t *v )
 {
-    FILE* f = fopen(filename, "w");
-    if (!f) {
-        perror("Failed to open file");
-        return; }
-
-    fprintf(f, "P3\n%d %d\n255\n", xsize, ysize);
-    for (int i = 0; i < xsize * ysize; i++) {
-        int iter = image[i];
-        if (iter == 0) {
-            fprintf(f, "0 0 0\n"); // Black for points in the set
-        } else {
-            // Simple coloring scheme
-            int r = (iter % 256);
-            int g = (iter * 2 % 256);
-            int b = (iter * 5 % 256);
-            fprintf(f, "%d %d %d\n", r, g, b);
-        }
+  const char *p = s;
+  dd_t  x   = { 0, 0 };
+  dd_t  ten = { 10, 0 };
+  int   sign = 1, exp10 = 0, ndigits = 0;
+  bool  dot = false;
+
+  if ( (*p == '+') || (*p == '-') )
+    sign = ( *p++ == '-' ? -1 : 1 );
+  for ( ; ((*p >= '0') && (*p <= '9')) || ((*p == '.') && !dot); p++ )
+    if ( *p == '.' )
+      dot = true;
+    else {
+      x = dd_add( dd_mul( x, ten ), (dd_t){ *p - '0', 0 } );
+      exp10 -= dot;
+      ndigits++; }
+  if ( ndigits == 0 )
+    return s;
+  if ( (*p == 'e') || (*p == 'E') ) {
+    char *end;
+    exp10 += (int)strtol( p + 1, &end, 10 );
+    p = end; }
+
+  dd_t scale = { 1, 0 };
+  for ( int e = (exp10 < 0 ? -exp10 : exp10); e > 0; e-- )
+    scale = dd_mul( scale, ten );
+  x = ( exp10 < 0 ? dd_div( x, scale ) : dd_mul( x, scale ) );
+  v->hi = sign * x.hi;
+  v->lo = sign * x.lo;
+  return p;
+}
+
+
+typedef struct {
+  int     len;                      // Z_0 .. Z_len
+  double *zx, *zy;                  // the reference orbit, rounded to double
+} ref_orbit_t;
+
+ref_orbit_t ref = { 0, NULL, NULL };
+
+/**
+ * @brief Computes the orbit of C in double-double, until it escapes or for
+ * max_iter iterations.
+ * @return 0 on success
+ */
+int ref_orbit_compute ( dd_t cx, dd_t cy, int max_iter )
+{
+  free( ref.zx );
+  ref.zx = (double*)malloc( 2 * ((size_t)max_iter + 1) * sizeof(double) );
+  if ( ref.zx == NULL )
+    return 1;
+  ref.zy = ref.zx + max_iter + 1;
+
+  dd_t zx = { 0, 0 }, zy = { 0, 0 };
+  int  n  = 0;
+  ref.zx[0] = ref.zy[0] = 0;
+  while ( n < max_iter )
+    {
+      dd_t zx_sq = dd_mul( zx, zx );
+      dd_t zy_sq = dd_mul( zy, zy );
+      dd_t zxy   = dd_mul( zx, zy );
+      zy = dd_add( dd_add( zxy, zxy ), cy );
+      zx = dd_add( dd_add( zx_sq, (dd_t){ -zy_sq.hi, -zy_sq.lo } ), cx );
+      n++;
+      ref.zx[n] = zx.hi + zx.lo;
+      ref.zy[n] = zy.hi + zy.lo;
+      if ( ref.zx[n] * ref.zx[n] + ref.zy[n] * ref.zy[n] > 4.0 )
+	break;
     }
-    fclose(f);
+  ref.len = n;
+  return 0;
 }
 
-int main ( int argc, char **argv)
+void ref_orbit_release ( void )
+{
+  free( ref.zx );
+  ref.zx = ref.zy = NULL;
+  ref.len = 0;
+}
 
+
+/**
+ * @brief The escape count of the pixel C + (dcx, dcy), as mandelbrot_point().
+ * @param rebases  incremented by the number of rebases
+ */
+static inline int perturb_point ( double dcx, double dcy, int max_iter, long *rebases )
 {
-  
-  unsigned int img_size[2] = { XSIZE_DFLT, YSIZE_DFLT };
-  unsigned int max_iter = MAX_ITER;
-  int init_patch = PATCH_SIDE_DEFAULT;
-  
-  if ( argc > 2 )
+  const double *Zx = ref.zx, *Zy = ref.zy;
+  double dx = 0.0, dy = 0.0;        // d_n
+  double x = 0.0, y = 0.0;          // z_n = Z_m + d_n
+  int    m = 0;
+  int    iter = 0;
+
+  while (iter < max_iter && x * x + y * y <= 4.0)
     {
-      img_size[0] = (unsigned int)atoi(*(argv+1));
-      img_size[1] = (unsigned int)atoi(*(argv+2));
-      if ( argc > 3 )
-	max_iter = (unsigned int)atoi(*(argv+3));
+      double ndx = 2.0 * (Zx[m] * dx - Zy[m] * dy) + (dx * dx - dy * dy) + dcx;
+      double ndy = 2.0 * (Zx[m] * dy + Zy[m] * dx) + 2.0 * dx * dy + dcy;
+      dx = ndx;
+      dy = ndy;
+      m++;
+      x = Zx[m] + dx;
+      y = Zy[m] + dy;
+      iter++;
+      if ( (x * x + y * y < dx * dx + dy * dy) || (m == ref.len) ) {
+	dx = x;
+	dy = y;
+	m  = 0;
+	(*rebases)++; }
+    }
 
-      if ( argc > 4 )
-	init_patch = (int)atoi(*(argv+4));
-      
+  return (iter == max_iter) ? 0 : iter;
+}
+
+static long perturb_scalar ( const double *dcx, const double *dcy, int n, int max_iter, int *iter )
+{
+  long rebases = 0;
+  for ( int k = 0; k < n; k++ )
+    iter[k] = perturb_point( dcx[k], dcy[k], max_iter, &rebases );
+  return rebases;
+}
+
+#if defined(HAVE_SIMD_KERNELS)
+
+/*
+ * After a rebase every lane is at its own point m of the reference orbit,
+ * which is gathered; the gathers of the lanes that are off are masked, so
+ * that their m stays in the orbit.
+ */
+__attribute__((target("avx2")))
+static long perturb_avx2 ( const double *dcx, const double *dcy, int n, int max_iter, int *iter )
+{
+  const __m256d four = _mm256_set1_pd( 4.0 );
+  const __m256d two  = _mm256_set1_pd( 2.0 );
+  const __m256i len  = _mm256_set1_epi64x( ref.len );
+  long rebases = 0;
+
+  for ( int k = 0; k < n; k += 4 )
+    {
+      // the last vector is padded with the last point, the padding lanes
+      // being off from the start
+      double px[4], py[4];
+      long long valid[4];
+      for ( int l = 0; l < 4; l++ ) {
+	px[l] = dcx[ k+l < n ? k+l : n-1 ];
+	py[l] = dcy[ k+l < n ? k+l : n-1 ];
+	valid[l] = ( k+l < n ? -1 : 0 ); }
+
+      const __m256d vdcx = _mm256_loadu_pd( px );
+      const __m256d vdcy = _mm256_loadu_pd( py );
+      __m256d dx = _mm256_setzero_pd(), dy = dx;
+      __m256d x  = dx, y = dx;
+      __m256i m  = _mm256_setzero_si256();
+      __m256i count = _mm256_setzero_si256();
+      __m256d active = _mm256_castsi256_pd( _mm256_loadu_si256( (const __m256i*)valid ) );
+
+      for ( int it = 0; it < max_iter; it++ )
+	{
+	  active = _mm256_and_pd( active, _mm256_cmp_pd( _mm256_add_pd( _mm256_mul_pd( x, x ), _mm256_mul_pd( y, y ) ), four, _CMP_LE_OQ ) );
+	  if ( _mm256_testz_pd( active, active ) )
+	    break;
+	  __m256d zx = _mm256_mask_i64gather_pd( _mm256_setzero_pd(), ref.zx, m, active, 8 );
+	  __m256d zy = _mm256_mask_i64gather_pd( _mm256_setzero_pd(), ref.zy, m, active, 8 );
+	  __m256d ndx = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( two, _mm256_sub_pd( _mm256_mul_pd( zx, dx ), _mm256_mul_pd( zy, dy ) ) ),
+						      _mm256_sub_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) ) ), vdcx );
+	  __m256d ndy = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( two, _mm256_add_pd( _mm256_mul_pd( zx, dy ), _mm256_mul_pd( zy, dx ) ) ),
+						      _mm256_mul_pd( _mm256_mul_pd( two, dx ), dy ) ), vdcy );
+	  dx = ndx;
+	  dy = ndy;
+	  // active lanes are all ones, i.e. -1
+	  m     = _mm256_sub_epi64( m, _mm256_castpd_si256( active ) );
+	  count = _mm256_sub_epi64( count, _mm256_castpd_si256( active ) );
+	  x = _mm256_add_pd( _mm256_mask_i64gather_pd( _mm256_setzero_pd(), ref.zx, m, active, 8 ), dx );
+	  y = _mm256_add_pd( _mm256_mask_i64gather_pd( _mm256_setzero_pd(), ref.zy, m, active, 8 ), dy );
+
+	  __m256d rebase = _mm256_or_pd(
+	    _mm256_cmp_pd( _mm256_add_pd( _mm256_mul_pd( x, x ), _mm256_mul_pd( y, y ) ),
+			   _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) ), _CMP_LT_OQ ),
+	    _mm256_castsi256_pd( _mm256_cmpeq_epi64( m, len ) ) );
+	  rebase = _mm256_and_pd( rebase, active );
+	  int nrebase = _mm256_movemask_pd( rebase );
+	  if ( nrebase ) {
+	    dx = _mm256_blendv_pd( dx, x, rebase );
+	    dy = _mm256_blendv_pd( dy, y, rebase );
+	    m  = _mm256_andnot_si256( _mm256_castpd_si256( rebase ), m );
+	    rebases += __builtin_popcount( nrebase ); }
+	}
+
+      long long c[4];
+      _mm256_storeu_si256( (__m256i*)c, count );
+      for ( int l = 0; (l < 4) && (k+l < n); l++ )
+	iter[k+l] = ( c[l] == max_iter ? 0 : (int)c[l] );
     }
+  return rebases;
+}
 
-  
-    unsigned int* image = (unsigned int*)malloc( img_size[0]*img_size[1] * sizeof(int));
-    if (!image) {
-        perror("Failed to allocate image memory");
-        return 1; }
 
-    printf("Calculating Mandelbrot set (%dx%d) with max %d iterations...\n", img_size[0], img_size[1], max_iter );
-    printf("Using patch size: %d\n", init_patch );
+__attribute__((target("avx512f")))
+static long perturb_avx512 ( const double *dcx, const double *dcy, int n, int max_iter, int *iter )
+{
+  const __m512d four = _mm512_set1_pd( 4.0 );
+  const __m512d two  = _mm512_set1_pd( 2.0 );
+  const __m512i one  = _mm512_set1_epi64( 1 );
+  const __m512i len  = _mm512_set1_epi64( ref.len );
+  long rebases = 0;
 
-    double start_time = omp_get_wtime();
+  for ( int k = 0; k < n; k += 8 )
+    {
+      // the lanes beyond n are masked out from the start
+      __mmask8 active = ( n - k >= 8 ? 0xff : (__mmask8)((1u << (n - k)) - 1) );
+
+      const __m512d vdcx = _mm512_maskz_loadu_pd( active, dcx + k );
+      const __m512d vdcy = _mm512_maskz_loadu_pd( active, dcy + k );
+      __m512d dx = _mm512_setzero_pd(), dy = dx;
+      __m512d x  = dx, y = dx;
+      __m512i m  = _mm512_setzero_si512();
+      __m512i count = _mm512_setzero_si512();
+
+      for ( int it = 0; it < max_iter; it++ )
+	{
+	  active = _mm512_mask_cmp_pd_mask( active, _mm512_add_pd( _mm512_mul_pd( x, x ), _mm512_mul_pd( y, y ) ), four, _CMP_LE_OQ );
+	  if ( active == 0 )
+	    break;
+	  __m512d zx = _mm512_mask_i64gather_pd( _mm512_setzero_pd(), active, m, ref.zx, 8 );
+	  __m512d zy = _mm512_mask_i64gather_pd( _mm512_setzero_pd(), active, m, ref.zy, 8 );
+	  __m512d ndx = _mm512_add_pd( _mm512_add_pd( _mm512_mul_pd( two, _mm512_sub_pd( _mm512_mul_pd( zx, dx ), _mm512_mul_pd( zy, dy ) ) ),
+						      _mm512_sub_pd( _mm512_mul_pd( dx, dx ), _mm512_mul_pd( dy, dy ) ) ), vdcx );
+	  __m512d ndy = _mm512_add_pd( _mm512_add_pd( _mm512_mul_pd( two, _mm512_add_pd( _mm512_mul_pd( zx, dy ), _mm512_mul_pd( zy, dx ) ) ),
+						      _mm512_mul_pd( _mm512_mul_pd( two, dx ), dy ) ), vdcy );
+	  dx = ndx;
+	  dy = ndy;
+	  m     = _mm512_mask_add_epi64( m, active, m, one );
+	  count = _mm512_mask_add_epi64( count, active, count, one );
+	  x = _mm512_add_pd( _mm512_mask_i64gather_pd( _mm512_setzero_pd(), active, m, ref.zx, 8 ), dx );
+	  y = _mm512_add_pd( _mm512_mask_i64gather_pd( _mm512_setzero_pd(), active, m, ref.zy, 8 ), dy );
+
+	  __mmask8 rebase =
+	    _mm512_mask_cmp_pd_mask( active, _mm512_add_pd( _mm512_mul_pd( x, x ), _mm512_mul_pd( y, y ) ),
+				     _mm512_add_pd( _mm512_mul_pd( dx, dx ), _mm512_mul_pd( dy, dy ) ), _CMP_LT_OQ ) |
+	    _mm512_mask_cmpeq_epi64_mask( active, m, len );
+	  if ( rebase ) {
+	    dx = _mm512_mask_mov_pd( dx, rebase, x );
+	    dy = _mm512_mask_mov_pd( dy, rebase, y );
+	    m  = _mm512_maskz_mov_epi64( (__mmask8)~rebase, m );
+	    rebases += __builtin_popcount( rebase ); }
+	}
+
+      long long c[8];
+      _mm512_storeu_si512( c, count );
+      for ( int l = 0; (l < 8) && (k+l < n); l++ )
+	iter[k+l] = ( c[l] == max_iter ? 0 : (int)c[l] );
+    }
+  return rebases;
+}
+
+#endif
 
-    #pragma omp parallel
+
+batch_kernel_t *escape_batch = escape_scalar;
+
+/**
+ * @brief Selects the batch kernel: the best one supported by the cpu, or
+ * the one named by isa ("avx512", "avx2", "scalar") if available; with
+ * check, the one with the fast path for the points in the set; with deep,
+ * the perturbation one (and check does not apply).
+ * @return the name of the kernel in use
+ */
+const char *select_kernel ( const char *isa, bool check, bool deep )
+{
+  const char *name = "scalar";
+  escape_batch = ( deep ? perturb_scalar : check ? escape_scalar_check : escape_scalar );
+ #if defined(HAVE_SIMD_KERNELS)
+  __builtin_cpu_init();
+  bool want_512 = (isa == NULL) || (strcmp( isa, "avx512" ) == 0);
+  bool want_2   = want_512 || (strcmp( isa, "avx2" ) == 0);
+  if ( want_512 && __builtin_cpu_supports("avx512f") ) {
+    escape_batch = ( deep ? perturb_avx512 : check ? escape_avx512_check : escape_avx512 );
+    name = "AVX-512"; }
+  else if ( want_2 && __builtin_cpu_supports("avx2") ) {
+    escape_batch = ( deep ? perturb_avx2 : check ? escape_avx2_check : escape_avx2 );
+    name = "AVX2"; }
+ #else
+  (void)isa;
+ #endif
+  return name;
+}
+
+
+// --- the render context
+//
+typedef struct {
+  int     xsize, ysize;             // resolution
+  double  x_min, x_max;             // viewport
+  double  y_min, y_max;
+  int     max_iter;
+  double *cx;                       // real part of every column, [xsize]
+  double *cy;                       // imaginary part of every row, [ysize]
+  int     band_rows;                // rows held in memory
+  int     y0, rows;                 // the band being rendered
+  int    *image;                    // iterations of every pixel of the band, [band_rows][xsize]
+  const int *hint;                  // the previous frame of an animation, whole; NULL if none
+  int    *hx, *hy;                  // its column and row nearest to every column and row, -1 outside
+} render_t;
+
+#define NOT_COMPUTED (-1)                   // the pixels not evaluated yet
+
+/**
+ * @brief The offset in R->image of the pixel (x, y), y being a row of the
+ * image within the band being rendered.
+ */
+static inline size_t pixel ( const render_t *R, int x, int y )
+{
+  return (size_t)(y - R->y0) * R->xsize + x;
+}
+
+
+/**
+ * @brief Sets the viewport of R, and the coordinates of its columns and rows.
+ */
+void render_viewport ( render_t *R, const double viewport[4] )
+{
+  R->x_min    = viewport[0];
+  R->x_max    = viewport[1];
+  R->y_min    = viewport[2];
+  R->y_max    = viewport[3];
+
+  for ( int x = 0; x < R->xsize; x++ )
+    R->cx[x] = R->x_min + x * (R->x_max - R->x_min) / R->xsize;
+  for ( int y = 0; y < R->ysize; y++ )
+    R->cy[y] = R->y_min + y * (R->y_max - R->y_min) / R->ysize;
+}
+
+
+/**
+ * @brief Sets up a render context, allocating the coordinate tables and
+ * the image of band_rows rows (ysize for the whole image).
+ * @return 0 on success
+ */
+int render_init ( render_t *R, int xsize, int ysize, int band_rows, const double viewport[4], int max_iter )
+{
+  R->xsize    = xsize;
+  R->ysize    = ysize;
+  R->band_rows = band_rows;
+  R->y0       = 0;
+  R->rows     = 0;
+  R->max_iter = max_iter;
+  R->hint     = NULL;
+
+  R->cx    = (double*)malloc( ((size_t)xsize + ysize) * sizeof(double) );
+  R->hx    = (int*)malloc( ((size_t)xsize + ysize) * sizeof(int) );
+  R->image = (int*)malloc( (size_t)xsize * band_rows * sizeof(int) );
+  if ( (R->cx == NULL) || (R->hx == NULL) || (R->image == NULL) ) {
+    free( R->cx );
+    free( R->hx );
+    free( R->image );
+    return 1; }
+  R->cy = R->cx + xsize;
+  R->hy = R->hx + xsize;
+
+  render_viewport( R, viewport );
+  return 0;
+}
+
+
+/**
+ * @brief Takes the hints of R from prev, the previous frame of an animation
+ * (whole, and of the same size): every pixel of R is mapped on the nearest
+ * pixel of prev, if the viewports overlap there.
+ */
+void render_reproject ( render_t *R, const render_t *prev )
+{
+  R->hint = prev->image;
+  for ( int x = 0; x < R->xsize; x++ ) {
+    long i = lround( (R->cx[x] - prev->x_min) / (prev->x_max - prev->x_min) * prev->xsize );
+    R->hx[x] = ( (i >= 0) && (i < prev->xsize) ? (int)i : -1 ); }
+  for ( int y = 0; y < R->ysize; y++ ) {
+    long i = lround( (R->cy[y] - prev->y_min) / (prev->y_max - prev->y_min) * prev->ysize );
+    R->hy[y] = ( (i >= 0) && (i < prev->ysize) ? (int)i : -1 ); }
+}
+
+
+/**
+ * @brief Whether the hints of the inside of a patch are all in the set (in)
+ * or all outside of it (!in); the pixels with no hint agree with anything.
+ */
+static bool hint_uniform ( const render_t *R, int x_start, int y_start, int size, bool in )
+{
+  for ( int y = y_start + 1; y < y_start + size - 1; y++ )
     {
-        #pragma omp single
-        {
-            printf("Running with %d OpenMP threads.\n", omp_get_num_threads());
-	    
-            for (int y = 0; y < img_size[1]; y += init_patch) {
-                for (int x = 0; x < img_size[0]; x += init_patch) {
-                    #pragma omp task
-                    compute_patch(image, x, y, img_size[0], img_size[1], init_patch);
-                }
-            }
-        }
-    } // Implicit barrier here ensures all tasks are complete
+      if ( R->hy[y] < 0 )
+	continue;
+      const int *row = R->hint + (size_t)R->hy[y] * R->xsize;
+      for ( int x = x_start + 1; x < x_start + size - 1; x++ )
+	if ( (R->hx[x] >= 0) && ((row[R->hx[x]] == 0) != in) )
+	  return false;
+    }
+  return true;
+}
 
-    double end_time = omp_get_wtime();
-    printf("Calculation finished in %.4f seconds.\n", end_time - start_time);
 
-    printf("Saving image to mandelbrot.ppm...\n");
-    //save_to_ppm(image, img_size[0], img_size[1], "mandelbrot.ppm");
-    save_to_png(image, img_size[0], img_size[1], "mandelbrot.png");
-    printf("Done.\n");
+/**
+ * @brief Starts the band of rows from y0, whose pixels are all NOT_COMPUTED.
+ */
+void render_band ( render_t *R, int y0 )
+{
+  R->y0   = y0;
+  R->rows = ( y0 + R->band_rows < R->ysize ? R->band_rows : R->ysize - y0 );
+
+ #pragma omp parallel for
+  for ( size_t i = 0; i < (size_t)R->xsize * R->rows; i++ )
+    R->image[i] = NOT_COMPUTED;
+}
+
+
+void render_release ( render_t *R )
+{
+  free( R->cx );
+  free( R->hx );
+  free( R->image );
+  R->cx    = R->cy = NULL;
+  R->hx    = R->hy = NULL;
+  R->image = NULL;
+  R->hint  = NULL;
+}
+
+// --- task granularity and statistics
+//
+long task_cutoff    = TASK_CUTOFF_DFLT;
+int  max_task_depth = TASK_DEPTH_DFLT;
+
+typedef struct {
+  long   ntasks;        // patches run as tasks
+  long   ninline;       // patches computed inline
+  double busy;          // seconds spent computing
+  long   events;        // summed returns of the kernels: iterations saved, or rebases
+  long   computed;      // points evaluated
+  long   reused;        // border points found in the image
+  long   steals;        // patches taken from another thread (work stealing)
+  long   vetoed;        // uniform borders not filled, the hints disagreeing
+  double first;         // when the first patch started, from run_start
+} __attribute__((aligned(64))) thread_stats_t;   // one cache line per thread
+
+thread_stats_t *stats = NULL;
+double run_start;
+
+
+// --- the execution engines
+//
+// ENGINE_TASKS     one thread creates a task for every initial patch, in
+//                  row order, and the sub-patches are tasks
+// ENGINE_TASKLOOP  the initial patches, in Morton order, are split by a
+//                  taskloop in tasks of grainsize patches
+// ENGINE_STEAL     a work-stealing pool: every thread has a deque of
+//                  patches, seeded with its own contiguous share of the
+//                  Morton order (neighbouring patches, so neighbouring rows
+//                  of the image), pushes its sub-patches on it and takes
+//                  them back from the same end; when it is empty, it steals
+//                  from the other end of the deque of another thread, which
+//                  holds the largest patches, the farthest from the owner's.
+// The deques are protected by a lock each: the time spent on them is
+// negligible with respect to a patch.
+
+enum { ENGINE_TASKS, ENGINE_TASKLOOP, ENGINE_STEAL };
+const char *engine_names[] = { "tasks", "taskloop", "steal" };
+int engine   = ENGINE_TASKS;
+int grainsize = 4;
+
+typedef struct {
+  int x, y, size, depth;
+  int root;             // the initial patch it descends from
+} work_t;               // size 0: the background job x (see render_patches())
+
+typedef struct {
+  omp_lock_t lock;
+  work_t    *items;     // items[head .. tail)
+  int        head, tail, cap;
+} __attribute__((aligned(64))) deque_t;
+
+struct {
+  deque_t *deque;       // one per thread
+  int     *pending;     // work items left of every initial patch
+  int     *band;        // the band of rows of every initial patch
+  long     outstanding; // work items queued or running
+} pool;
+
+// the initial patch of the work item being run by this thread
+int  current_root  = 0;
+#pragma omp threadprivate(current_root)
+
+
+static void pool_push ( deque_t *D, work_t w )
+{
+  omp_set_lock( &D->lock );
+  if ( D->tail == D->cap )
+    {
+      // drop the consumed head, and grow if still full
+      if ( D->head > 0 ) {
+	memmove( D->items, D->items + D->head, (D->tail - D->head) * sizeof(work_t) );
+	D->tail -= D->head;
+	D->head  = 0; }
+      if ( D->tail == D->cap ) {
+	D->cap   = 2 * D->cap + 64;
+	D->items = (work_t*)realloc( D->items, D->cap * sizeof(work_t) );
+	if ( D->items == NULL ) {
+	  fprintf( stderr, "unable to grow the work queue\n" );
+	  exit( 1 ); } }
+    }
+  D->items[D->tail++] = w;
+  omp_unset_lock( &D->lock );
+}
+
+/**
+ * @brief Takes a work item from the tail of D (the owner) or from its head
+ * (a thief).
+ * @return whether there was one
+ */
+static bool pool_take ( deque_t *D, bool from_head, work_t *w )
+{
+  bool found = false;
+  omp_set_lock( &D->lock );
+  if ( D->head < D->tail ) {
+    *w = ( from_head ? D->items[D->head++] : D->items[--D->tail] );
+    found = true; }
+  omp_unset_lock( &D->lock );
+  return found;
+}
+
+/**
+ * @brief Queues a sub-patch of the work item being run, on the deque of the
+ * calling thread.
+ */
+static void pool_spawn ( int x, int y, int size, int depth )
+{
+ #pragma omp atomic
+  pool.pending[current_root]++;
+ #pragma omp atomic
+  pool.outstanding++;
+  pool_push( &pool.deque[omp_get_thread_num()], (work_t){ x, y, size, depth, current_root } );
+}
+
+
+// --- the border cache
+//
+// The image itself caches the points already evaluated: every pixel starts
+// as NOT_COMPUTED and the border of every patch is written with its exact
+// values. The outer half of the border of a sub-patch lies on the border of
+// its parent, and is found in the image instead of being evaluated again.
+// Sub-patches are disjoint, and a task is created after its parent has
+// written its border, so that no pixel is written by two threads and none
+// is read before it is written.
+
+/**
+ * @brief The coordinates of the b-th point of the border of a patch: top
+ * and bottom rows, then left and right columns without the corners.
+ */
+static inline void border_point ( int b, int x_start, int y_start, int size, int side, int *px, int *py )
+{
+  if ( b < size )                 { *px = x_start + b;            *py = y_start; }
+  else if ( b < 2*size )          { *px = x_start + b - size;     *py = y_start + size - 1; }
+  else if ( b < 2*size + side )   { *px = x_start;                *py = y_start + 1 + b - 2*size; }
+  else                            { *px = x_start + size - 1;     *py = y_start + 1 + b - 2*size - side; }
+}
+
+/**
+ * @brief Evaluates a batch of n points and writes them in the image at the
+ * offsets pix.
+ */
+static inline void evaluate_batch ( const render_t *R, const double *bx, const double *by, const size_t *pix,
+				    int n, thread_stats_t *my )
+{
+  int values[BATCH];
+  my->events   += escape_batch( bx, by, n, R->max_iter, values );
+  my->computed += n;
+  for ( int k = 0; k < n; k++ )
+    R->image[ pix[k] ] = values[k];
+}
+
+
+// Forward declaration for the recursive function
+void compute_patch(const render_t *R, int x_start, int y_start, int size, int depth, bool is_task);
+
+/**
+ * @brief Main recursive function to compute a patch of the Mandelbrot set.
+ * depth is the recursion level below the initial patches, is_task tells
+ * whether the call is the body of a task or has been made inline.
+ */
+void compute_patch(const render_t *R, int x_start, int y_start, int size, int depth, bool is_task)
+{
+    int * restrict image = R->image;
+    const int max_iter = R->max_iter;
+
+    thread_stats_t *my = &stats[omp_get_thread_num()];
+    double tstart = omp_get_wtime();
+    if ( my->ntasks + my->ninline == 0 ) my->first = tstart - run_start;
+    if ( is_task ) my->ntasks++; else my->ninline++;
+
+    bool uniform = true;                // all the border points have the same count
+    int  border_value = NOT_COMPUTED;   // which is this one
+    long border_work = 0;
+    int border_points = 0;
+
+    // 1. Evaluate the points of the border that are not in the image yet,
+    //    in batches
+    double bx[BATCH], by[BATCH];
+    size_t pix[BATCH];
+    int    side = (size > 2 ? size - 2 : 0);
+    int    nborder = 2 * size + 2 * side;
+    int    n = 0;
+
+    for (int b = 0; b < nborder; b++)
+      {
+	int px, py;
+	border_point( b, x_start, y_start, size, side, &px, &py );
+	if ( image[pixel( R, px, py )] != NOT_COMPUTED ) {
+	  my->reused++;
+	  continue; }
+	bx[n]  = R->cx[px];
+	by[n]  = R->cy[py];
+	pix[n] = pixel( R, px, py );
+	if ( ++n == BATCH ) {
+	  evaluate_batch( R, bx, by, pix, n, my );
+	  n = 0; }
+      }
+    if ( n > 0 )
+      evaluate_batch( R, bx, by, pix, n, my );
+
+    // 2. evaluate the border
+    for (int b = 0; b < nborder; b++)
+      {
+	int px, py;
+	border_point( b, x_start, y_start, size, side, &px, &py );
+	int value = image[pixel( R, px, py )];
+	if (b == 0) border_value = value;
+	else if (value != border_value) uniform = false;
+	border_work += (value == 0 ? max_iter : value);
+	border_points++;
+      }
+
+    // 3. a uniform border around an inside that was not uniform in the
+    //    previous frame of an animation hides a detail: treat it as mixed
+    if ( uniform && (R->hint != NULL) && !hint_uniform( R, x_start, y_start, size, border_value == 0 ) ) {
+      uniform = false;
+      my->vetoed++; }
+
+    if (uniform)
+      {
+        // Fill the inside of the patch with the count of the border: 0
+        // inside the set, the same escape count outside of it
+        for (int y = y_start + 1; y < y_start + size - 1; y++)
+	  {
+            for (int x = x_start + 1; x < x_start + size - 1; x++)
+	      image[pixel( R, x, y )] = border_value;
+	  }
+      } else
+      {
+        // 4. Mixed border: subdivide or compute directly
+        if (size <= 8)
+	  { //If patch is small, compute all the points inside the border (at most 36)
+	    n = 0;
+            for (int y = y_start + 1; y < y_start + size - 1; y++)
+	      for (int x = x_start + 1; x < x_start + size - 1; x++, n++) {
+		bx[n]  = R->cx[x];
+		by[n]  = R->cy[y];
+		pix[n] = pixel( R, x, y ); }
+	    if ( n > 0 )
+	      evaluate_batch( R, bx, by, pix, n, my );
+	  }
+	else
+	  {
+            // Recursive step: split into 4 sub-patches, tasks if worth it
+	    int  new_size = size / 2;
+	    long est_work = border_work / border_points * new_size * new_size;
+	    // the same rule for every engine: only the patches above
+	    // max_task_depth create tasks (those below are in final tasks)
+	    bool as_tasks = (depth < max_task_depth) && (est_work >= task_cutoff);
+
+	    my->busy += omp_get_wtime() - tstart;
+
+	    for ( int q = 0; q < 4; q++ )
+	      {
+		int xs = x_start + (q & 1) * new_size;
+		int ys = y_start + (q >> 1) * new_size;
+		if ( as_tasks && (engine == ENGINE_STEAL) )
+		  pool_spawn(xs, ys, new_size, depth + 1);
+		else if ( as_tasks )
+		  {
+		   #pragma omp task final( depth + 1 >= max_task_depth ) mergeable
+		    compute_patch(R, xs, ys, new_size, depth + 1, true);
+		  }
+		else
+		  compute_patch(R, xs, ys, new_size, depth + 1, false);
+	      }
+	    return;
+	  }
+      }
+
+    my->busy += omp_get_wtime() - tstart;
+    return;
+}
+
+// --- output
+//
+// The colour of a pixel depends on its iteration count only, so that any
+// band of rows can be coloured and encoded independently of the others.
+// A PNG holds one zlib stream, but a zlib stream can be the concatenation
+// of independent raw deflate streams, each one ended by a sync flush (an
+// empty stored block, that brings it to a byte boundary) but the last; the
+// adler32 checksum of the whole is combined from those of the pieces. So
+// every band of rows is filtered and compressed by itself, by the thread
+// that computed its last patch while the others go on computing, and the
+// bands are written in order, as soon as they and all the previous ones
+// are ready, in one IDAT chunk each.
+// Compiled with -DNO_ZLIB the PNG is written at the end by stb_image_write.
+
+static inline void colour ( int iter, unsigned char *rgb )
+{
+  if (iter == 0)
+    {
+      rgb[0] = 0;   // R
+      rgb[1] = 0;   // G
+      rgb[2] = 0;   // B (Black)
+    }
+  else
+    {
+      // Simple coloring scheme
+      rgb[0] = (iter % 256);         // R
+      rgb[1] = (iter * 2 % 256);     // G
+      rgb[2] = (iter * 5 % 256);     // B
+    }
+}
+
+/**
+ * @brief Saves the image data to a PNG file using stb_image_write.
+ * @param image Pointer to the raw iteration data.
+ * @param filename The name of the output file.
+ */
+void save_to_png(int* image, int xsize, int ysize, const char* filename)
+{
+    // PNG needs a buffer of unsigned char in RGB format (3 bytes per pixel).
+  size_t num_pixels = (size_t)xsize * ysize;
+  unsigned char* pixel_data = (unsigned char*)malloc(num_pixels * 3 * sizeof(unsigned char));
+  if (!pixel_data) {
+    perror("Failed to allocate pixel buffer for PNG");
+    return;
+  }
+  
+  // Convert iteration counts to colors, mapping each pixel to 3 bytes (R, G, B)
+ #pragma omp parallel for
+  for (size_t i = 0; i < num_pixels; i++)
+    colour( image[i], &pixel_data[i * 3] );
+  
+  // Write the PNG file.
+  // stbi_write_png arguments: filename, width, height, channels, data, stride.
+  // Stride is the number of bytes per row (width * channels).
+  if (!stbi_write_png(filename, xsize, ysize, 3, pixel_data, xsize * 3)) {
+    fprintf(stderr, "ERROR: could not write PNG file %s\n", filename);
+  }
+  
+  free(pixel_data);
+}
+
+/**
+ * @brief Starts a binary (P6) PPM file, whose pixels are then appended by
+ * ppm_write_band().
+ * @return the file, NULL on failure
+ */
+FILE *ppm_open(const char* filename, int xsize, int ysize)
+{
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        perror("Failed to open file");
+        return NULL; }
+    if (fprintf(f, "P6\n%d %d\n255\n", xsize, ysize) < 0) {
+        fprintf(stderr, "ERROR: could not write PPM file %s\n", filename);
+        fclose(f);
+        return NULL; }
+    return f;
+}
+
+/**
+ * @brief Appends the band being rendered to a PPM file, coloured in
+ * parallel and written at once.
+ * @return 0 on success
+ */
+int ppm_write_band(const render_t *R, FILE *f)
+{
+    size_t num_pixels = (size_t)R->xsize * R->rows;
+    unsigned char *data = (unsigned char*)malloc(num_pixels * 3);
+    if (!data) {
+        perror("Failed to allocate pixel buffer for PPM");
+        return 1; }
+
+   #pragma omp parallel for
+    for (size_t i = 0; i < num_pixels; i++)
+      colour( R->image[i], &data[i * 3] );
+
+    int failed = ( fwrite(data, num_pixels * 3, 1, f) != 1 );
+    free(data);
+    return failed;
+}
+
+
+#if !defined(NO_ZLIB)
+
+typedef struct {
+  unsigned char *data;              // the compressed band, NULL until ready
+  size_t         len;
+  size_t         raw_len;           // the filtered rows
+  unsigned long  adler;             // of the filtered rows
+} png_band_t;
+
+typedef struct {
+  FILE           *f;
+  const char     *name;
+  const render_t *R;
+  int             band_rows;
+  int             nbands;
+  int             next;             // the next band to be written
+  unsigned long   adler;            // of the bands written
+  int            *pending;          // patches not finished in every band
+  png_band_t     *band;
+  double          encode_time;      // summed over the threads
+  size_t          bytes;
+  bool            failed;
+} png_stream_t;
+
+
+static inline void put32 ( unsigned char *p, unsigned long v )
+{
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+/**
+ * @brief Writes a PNG chunk whose data are head, body and tail.
+ */
+static void png_chunk ( png_stream_t *W, const char *type,
+			const unsigned char *head, size_t hlen,
+			const unsigned char *body, size_t blen,
+			const unsigned char *tail, size_t tlen )
+{
+  unsigned char len[4], crc[4];
+  // remind: crc32() with a NULL buffer returns the initial value
+  unsigned long c = crc32( 0L, (const Bytef*)type, 4 );
+  if ( hlen > 0 ) c = crc32( c, head, hlen );
+  if ( blen > 0 ) c = crc32( c, body, blen );
+  if ( tlen > 0 ) c = crc32( c, tail, tlen );
+  put32( len, hlen + blen + tlen );
+  put32( crc, c );
+
+  bool ok = ( fwrite( len, 4, 1, W->f ) == 1 ) && ( fwrite( type, 4, 1, W->f ) == 1 ) &&
+    ( (hlen == 0) || (fwrite( head, hlen, 1, W->f ) == 1) ) &&
+    ( (blen == 0) || (fwrite( body, blen, 1, W->f ) == 1) ) &&
+    ( (tlen == 0) || (fwrite( tail, tlen, 1, W->f ) == 1) ) &&
+    ( fwrite( crc, 4, 1, W->f ) == 1 );
+  if ( !ok && !W->failed ) {
+    fprintf( stderr, "ERROR: could not write PNG file %s\n", W->name );
+    W->failed = true; }
+  W->bytes += 12 + hlen + blen + tlen;
+}
+
+
+/**
+ * @brief Starts a PNG file for R, to be written in bands of band_rows rows,
+ * each of which will be complete after patches_per_band calls to
+ * png_stream_patch_done().
+ * @return 0 on success
+ */
+int png_stream_open ( png_stream_t *W, const render_t *R, const char *fname,
+		      int band_rows, int patches_per_band )
+{
+  memset( W, 0, sizeof(*W) );
+  W->R         = R;
+  W->name      = fname;
+  W->band_rows = band_rows;
+  W->nbands    = (R->ysize + band_rows - 1) / band_rows;
+  W->adler     = adler32( 0L, Z_NULL, 0 );
+  W->band      = (png_band_t*)calloc( W->nbands, sizeof(png_band_t) );
+  W->pending   = (int*)malloc( W->nbands * sizeof(int) );
+  W->f         = fopen( fname, "wb" );
+  if ( (W->band == NULL) || (W->pending == NULL) || (W->f == NULL) ) {
+    perror( "Failed to start the PNG file" );
+    free( W->band );
+    free( W->pending );
+    if ( W->f != NULL ) fclose( W->f );
+    return 1; }
+  for ( int b = 0; b < W->nbands; b++ )
+    W->pending[b] = patches_per_band;
+
+  // signature and header: 8 bits per channel, RGB, no interlace
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  unsigned char ihdr[13] = { 0 };
+  put32( ihdr, R->xsize );
+  put32( ihdr + 4, R->ysize );
+  ihdr[8] = 8;
+  ihdr[9] = 2;
+  if ( fwrite( signature, 8, 1, W->f ) != 1 ) {
+    fprintf( stderr, "ERROR: could not write PNG file %s\n", fname );
+    W->failed = true; }
+  W->bytes = 8;
+  png_chunk( W, "IHDR", ihdr, 13, NULL, 0, NULL, 0 );
+  return 0;
+}
+
+
+/**
+ * @brief Colours, filters and compresses the band b.
+ */
+static void png_encode_band ( png_stream_t *W, int b )
+{
+  double t0 = omp_get_wtime();
+  const render_t *R = W->R;
+  int    y0   = b * W->band_rows;
+  int    y1   = ( y0 + W->band_rows < R->ysize ? y0 + W->band_rows : R->ysize );
+  size_t line = 1 + 3 * (size_t)R->xsize;
+  bool   last = ( b == W->nbands - 1 );
+
+  png_band_t *B = &W->band[b];
+  B->raw_len = (y1 - y0) * line;
+  unsigned char *raw  = (unsigned char*)malloc( B->raw_len + 2 * line );
+  unsigned char *prev = raw + B->raw_len;
+  unsigned char *cur  = prev + line;
+
+  z_stream zs;
+  memset( &zs, 0, sizeof(zs) );
+  if ( (raw == NULL) || (deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK) ) {
+    fprintf( stderr, "ERROR: could not set up the compression of band %d\n", b );
+    exit( 1 ); }
+
+  // the "up" filter: every byte minus the one in the row above. The row
+  // above the band may still be in the making, so the first row of the band
+  // has the "sub" filter instead: every byte minus the one of the pixel on
+  // the left
+  for ( int y = y0; y < y1; y++ )
+    {
+      unsigned char *out = raw + (y - y0) * line;
+      for ( int x = 0; x < R->xsize; x++ )
+	colour( R->image[pixel( R, x, y )], &cur[1 + 3*x] );
+      if ( y == y0 ) {
+	out[0] = 1;
+	for ( size_t i = 1; i < line; i++ )
+	  out[i] = ( i > 3 ? cur[i] - cur[i-3] : cur[i] ); }
+      else {
+	out[0] = 2;
+	for ( size_t i = 1; i < line; i++ )
+	  out[i] = cur[i] - prev[i]; }
+      unsigned char *swap = prev; prev = cur; cur = swap;
+    }
+  B->adler = adler32( adler32( 0L, Z_NULL, 0 ), raw, B->raw_len );
+
+  // a raw deflate stream, ended by a sync flush but for the last band
+  size_t bound = deflateBound( &zs, B->raw_len ) + 16;
+  unsigned char *data = (unsigned char*)malloc( bound );
+  if ( data == NULL ) {
+    fprintf( stderr, "ERROR: could not allocate the compressed band %d\n", b );
+    exit( 1 ); }
+  zs.next_in   = raw;
+  zs.avail_in  = B->raw_len;
+  zs.next_out  = data;
+  zs.avail_out = bound;
+  int ret = deflate( &zs, last ? Z_FINISH : Z_SYNC_FLUSH );
+  if ( (ret != (last ? Z_STREAM_END : Z_OK)) || (zs.avail_in != 0) ) {
+    fprintf( stderr, "ERROR: could not compress band %d\n", b );
+    exit( 1 ); }
+  B->len = bound - zs.avail_out;
+  deflateEnd( &zs );
+  free( raw );
+
+ #pragma omp atomic
+  W->encode_time += omp_get_wtime() - t0;
+ #pragma omp atomic write
+  B->data = data;
+}
+
+
+/**
+ * @brief Writes the bands that are ready, in order.
+ */
+static void png_write_ready ( png_stream_t *W )
+{
+ #pragma omp critical (png_stream)
+  while ( W->next < W->nbands )
+    {
+      png_band_t    *B;
+      unsigned char *data;
+      B = &W->band[W->next];
+     #pragma omp atomic read
+      data = B->data;
+      if ( data == NULL )
+	break;
+
+      // the zlib header goes before the first band, the checksum of the
+      // whole stream after the last one
+      static const unsigned char zhead[2] = { 0x78, 0x01 };
+      unsigned char ztail[4];
+      W->adler = adler32_combine( W->adler, B->adler, B->raw_len );
+      put32( ztail, W->adler );
+      bool last = ( W->next == W->nbands - 1 );
+      png_chunk( W, "IDAT", zhead, (W->next == 0 ? 2 : 0), data, B->len, ztail, (last ? 4 : 0) );
+
+      free( data );
+      B->data = NULL;
+      W->next++;
+    }
+}
+
+
+/**
+ * @brief To be called when one of the patches of band b is done: the last
+ * one encodes the band and writes it, if it is its turn.
+ */
+void png_stream_patch_done ( png_stream_t *W, int b )
+{
+  int left;
+ #pragma omp atomic capture
+  left = --W->pending[b];
+  if ( left > 0 )
+    return;
+  png_encode_band( W, b );
+  png_write_ready( W );
+}
+
+
+/**
+ * @brief Ends the PNG file.
+ * @return 0 on success
+ */
+int png_stream_close ( png_stream_t *W )
+{
+  if ( W->next != W->nbands ) {
+    fprintf( stderr, "ERROR: %d bands of %s not written\n", W->nbands - W->next, W->name );
+    W->failed = true; }
+  png_chunk( W, "IEND", NULL, 0, NULL, 0, NULL, 0 );
+  if ( (fclose( W->f ) != 0) && !W->failed ) {
+    fprintf( stderr, "ERROR: could not write PNG file %s\n", W->name );
+    W->failed = true; }
+  free( W->band );
+  free( W->pending );
+  return W->failed;
+}
+
+#endif
+
+// --- running the engines on a band
+//
+
+#if !defined(NO_ZLIB)
+png_stream_t *png_out = NULL;       // the PNG being streamed, if any
+#endif
+
+// independent jobs that the engines run along with the patches: writing
+// the previous frame of an animation
+struct {
+  int    n;
+  void (*run)( int );
+} background = { 0, NULL };
+
+/**
+ * @brief To be called when an initial patch and all of its sub-patches are
+ * done.
+ */
+static inline void patch_done ( int band )
+{
+ #if !defined(NO_ZLIB)
+  if ( png_out != NULL )
+    png_stream_patch_done( png_out, band );
+ #else
+  (void)band;
+ #endif
+}
+
+static inline bool streaming ( void )
+{
+ #if !defined(NO_ZLIB)
+  return ( png_out != NULL );
+ #else
+  return false;
+ #endif
+}
+
+/**
+ * @brief The body of the task of an initial patch: when the image is
+ * streamed, it waits for all the sub-patches to report the patch done.
+ */
+static void run_patch ( const render_t *R, int x, int y, int size )
+{
+  if ( !streaming() ) {
+    compute_patch( R, x, y, size, 0, true );
+    return; }
+
+ #pragma omp taskgroup
+  compute_patch( R, x, y, size, 0, true );
+  patch_done( y / size );
+}
+
+
+static inline unsigned int morton_compact ( unsigned int v )
+{
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
+/**
+ * @brief The initial patches of the band being rendered, in Morton (Z)
+ * order, in pos[2*i], pos[2*i+1]: the patches close in the order are close
+ * in the image.
+ * @return the number of patches
+ */
+int morton_order ( const render_t *R, int patch, int *pos )
+{
+  int ncols = R->xsize / patch;
+  int nrows = R->rows / patch;
+  unsigned int side = 1;
+  while ( (side < (unsigned)ncols) || (side < (unsigned)nrows) )
+    side *= 2;
+
+  int n = 0;
+  for ( unsigned long code = 0; code < (unsigned long)side * side; code++ )
+    {
+      int ix = morton_compact( code );
+      int iy = morton_compact( code >> 1 );
+      if ( (ix < ncols) && (iy < nrows) ) {
+	pos[2*n]     = ix * patch;
+	pos[2*n + 1] = R->y0 + iy * patch;
+	n++; }
+    }
+  return n;
+}
+
+
+/**
+ * @brief Runs the work-stealing pool on the n initial patches at pos.
+ */
+void pool_run ( const render_t *R, int patch, const int *pos, int n )
+{
+  // the deques and the stats are allocated for this many threads
+  int nthreads = omp_get_max_threads();
+  pool.pending = (int*)malloc( 2 * (size_t)n * sizeof(int) );
+  if ( pool.pending == NULL ) {
+    fprintf( stderr, "unable to allocate the work pool\n" );
+    exit( 1 ); }
+  pool.band        = pool.pending + n;
+  pool.outstanding = n + background.n;
+  for ( int i = 0; i < n; i++ ) {
+    pool.pending[i] = 1;
+    pool.band[i]    = pos[2*i + 1] / patch; }
+
+ #pragma omp parallel num_threads(nthreads)
+  {
+    int      me   = omp_get_thread_num();
+    int      team = omp_get_num_threads();    // can be less than nthreads (OMP_DYNAMIC, limits)
+    deque_t *D    = &pool.deque[me];
+
+    // every thread seeds its own deque, with its share of the order pushed
+    // backwards, so that it takes it back in order
+    int lo = (long)n * me / team;
+    int hi = (long)n * (me + 1) / team;
+    for ( int i = hi - 1; i >= lo; i-- )
+      pool_push( D, (work_t){ pos[2*i], pos[2*i + 1], patch, 0, i } );
+    // and its share of the background jobs, on top
+    for ( int i = me; i < background.n; i += team )
+      pool_push( D, (work_t){ i, 0, 0, 0, -1 } );
+   #pragma omp barrier
+
+    work_t w;
+    int    victim = me;
+    for ( ;; )
+      {
+	bool found = pool_take( D, false, &w );
+	for ( int k = 1; !found && (k < team); k++ )
+	  {
+	    victim = ( victim + 1 ) % team;
+	    if ( victim != me && (found = pool_take( &pool.deque[victim], true, &w )) )
+	      stats[me].steals++;
+	  }
+	if ( !found )
+	  {
+	    long left;
+	   #pragma omp atomic read
+	    left = pool.outstanding;
+	    if ( left == 0 )
+	      break;
+	    continue;
+	  }
+
+	if ( w.size == 0 )
+	  {
+	    background.run( w.x );
+	   #pragma omp atomic
+	    pool.outstanding--;
+	    continue;
+	  }
+
+	current_root  = w.root;
+	compute_patch( R, w.x, w.y, w.size, w.depth, true );
+
+	int pending;
+       #pragma omp atomic capture
+	pending = --pool.pending[w.root];
+	if ( pending == 0 )
+	  patch_done( pool.band[w.root] );
+       #pragma omp atomic
+	pool.outstanding--;
+      }
+  }
+
+  free( pool.pending );
+}
+
+
+/**
+ * @brief Computes the band of rows being rendered with the engine chosen,
+ * and runs the background jobs meanwhile.
+ */
+void render_patches ( const render_t *R, int patch, int *pos )
+{
+  int n = ( engine == ENGINE_TASKS ? 0 : morton_order( R, patch, pos ) );
+
+  if ( engine == ENGINE_STEAL ) {
+    pool_run( R, patch, pos, n );
+    return; }
+
+ #pragma omp parallel
+  {
+   #pragma omp single
+    {
+      for ( int i = 0; i < background.n; i++ )
+	{
+	 #pragma omp task
+	  background.run( i );
+	}
+
+      if ( engine == ENGINE_TASKLOOP )
+	{
+	 #pragma omp taskloop grainsize(grainsize)
+	  for ( int i = 0; i < n; i++ )
+	    run_patch( R, pos[2*i], pos[2*i + 1], patch );
+	}
+      else
+	for ( int y = R->y0; y < R->y0 + R->rows; y += patch )
+	  for ( int x = 0; x < R->xsize; x += patch )
+	    {
+	     #pragma omp task
+	      run_patch( R, x, y, patch );
+	    }
+    }
+  } // Implicit barrier here ensures all tasks are complete
+}
+
+
+/**
+ * @brief Prints the histogram of the busy times of the threads.
+ */
+void print_histogram ( int nthreads, double elapsed )
+{
+  const int nbins = 10;
+  double lo = stats[0].busy, hi = stats[0].busy;
+  for ( int t = 1; t < nthreads; t++ ) {
+    lo = ( stats[t].busy < lo ? stats[t].busy : lo );
+    hi = ( stats[t].busy > hi ? stats[t].busy : hi ); }
+  double width = ( hi > lo ? (hi - lo) / nbins : 1 );
+
+  int count[nbins];
+  memset( count, 0, sizeof(count) );
+  for ( int t = 0; t < nthreads; t++ ) {
+    int b = (int)( (stats[t].busy - lo) / width );
+    count[ b < nbins ? b : nbins - 1 ]++; }
+
+  printf("Busy time of the threads, %% of the elapsed time:\n");
+  for ( int b = 0; b < nbins; b++ )
+    {
+      if ( (hi == lo) && (b > 0) )
+	break;
+      printf("   %5.1f%% - %5.1f%% %5d  ", 100 * (lo + b * width) / elapsed,
+	     100 * (hi > lo ? lo + (b + 1) * width : hi) / elapsed, count[b] );
+      for ( int k = 0; k < (count[b] * 50 + nthreads - 1) / nthreads; k++ )
+	putchar( '#' );
+      putchar( '\n' );
+    }
+}
+
+// --- zoom animation
+//
+// With -a frames[,factor] the viewport shrinks by factor at every frame,
+// around its centre (the reference point, for a deep zoom), and every
+// frame is written to a file of its own, named by the output name with the
+// frame number in its %d conversion. The frames are rendered by the same
+// process, in two images used in turn: while frame k+1 is computed in one
+// of them, frame k is written from the other one by the background jobs
+// of the engines, one per band of patch rows of a PNG (coloured, filtered
+// and compressed as when streaming), one for a whole PPM.
+// The previous frame also gives the hints of the next one: its pixels are
+// re-projected on the new viewport (render_reproject()), and a patch with
+// a uniform border is filled only if the hints of its inside are uniform
+// as well; otherwise it is split, and the detail that the border did not
+// touch is found.
+
+struct {
+  const render_t *R;                // the frame being written
+  char            name[1024];
+  bool            ppm;
+ #if !defined(NO_ZLIB)
+  png_stream_t    W;
+ #endif
+  int             failed;
+  double          encode_time;      // of all the PNG frames, summed over the threads
+  size_t          bytes;
+} frame_out;
+
+
+/**
+ * @brief The background job i of the frame being written.
+ */
+static void frame_job ( int i )
+{
+ #if !defined(NO_ZLIB)
+  if ( !frame_out.ppm ) {
+    png_stream_patch_done( &frame_out.W, i );
+    return; }
+ #endif
+  (void)i;
+  const render_t *R = frame_out.R;
+  if ( frame_out.ppm )
+    {
+      FILE *f = ppm_open( frame_out.name, R->xsize, R->ysize );
+      int failed = ( f == NULL ) || ppm_write_band( R, f );
+      if ( f != NULL )
+	failed |= ( fclose( f ) != 0 );
+      if ( failed )
+	fprintf( stderr, "ERROR: could not write PPM file %s\n", frame_out.name );
+      frame_out.failed |= failed;
+    }
+  else
+    save_to_png( R->image, R->xsize, R->ysize, frame_out.name );
+}
+
+
+/**
+ * @brief Starts writing the frame number k, in R, by the background jobs;
+ * a PNG in bands of band_rows rows.
+ * @return 0 on success
+ */
+static int frame_open ( const render_t *R, const char *pattern, int k, bool ppm, int band_rows )
+{
+  frame_out.R   = R;
+  frame_out.ppm = ppm;
+  snprintf( frame_out.name, sizeof(frame_out.name), pattern, k );
+  background.run = frame_job;
+  background.n   = 1;
+ #if !defined(NO_ZLIB)
+  if ( !ppm ) {
+    if ( png_stream_open( &frame_out.W, R, frame_out.name, band_rows, 1 ) )
+      return 1;
+    background.n = frame_out.W.nbands; }
+ #else
+  (void)band_rows;
+ #endif
+  return 0;
+}
+
+
+/**
+ * @brief Ends the frame written by the background jobs, once they are all
+ * done.
+ */
+static void frame_close ( void )
+{
+  background.n = 0;
+ #if !defined(NO_ZLIB)
+  if ( !frame_out.ppm ) {
+    frame_out.failed      |= png_stream_close( &frame_out.W );
+    frame_out.encode_time += frame_out.W.encode_time;
+    frame_out.bytes       += frame_out.W.bytes; }
+ #endif
+}
+
+
+static long total_vetoed ( void )
+{
+  long vetoed = 0;
+  for ( int t = 0; t < omp_get_max_threads(); t++ )
+    vetoed += stats[t].vetoed;
+  return vetoed;
+}
+
+
+/**
+ * @brief Renders and writes the frames of the animation, in R and R2 in
+ * turn; both start with the viewport of the first frame.
+ * @return 0 on success
+ */
+int render_animation ( render_t *R, render_t *R2, int patch, int *pos, int frames, double factor,
+		       const char *pattern, bool ppm )
+{
+  render_t *frame[2] = { R, R2 };
+  double xc = 0.5 * (R->x_min + R->x_max);
+  double yc = 0.5 * (R->y_min + R->y_max);
+  double hw = 0.5 * (R->x_max - R->x_min);
+  double hh = 0.5 * (R->y_max - R->y_min);
+
+  for ( int k = 0; k < frames; k++ )
+    {
+      render_t *F = frame[k % 2];
+      double t0 = omp_get_wtime();
+      long   vetoed = total_vetoed();
+
+      if ( k > 0 )
+	{
+	  double scale = pow( factor, k );
+	  double viewport[4] = { xc - hw * scale, xc + hw * scale, yc - hh * scale, yc + hh * scale };
+	  render_viewport( F, viewport );
+	  render_reproject( F, frame[(k - 1) % 2] );
+	  // the previous frame is written while this one is computed
+	  if ( frame_open( frame[(k - 1) % 2], pattern, k - 1, ppm, patch ) )
+	    return 1;
+	}
+
+      render_band( F, 0 );
+      render_patches( F, patch, pos );
+      if ( k > 0 )
+	frame_close();
+
+      printf("   frame %4d: half width %.6e, %.4f s, %ld uniform fills vetoed by the hints\n",
+	     k, 0.5 * (F->x_max - F->x_min), omp_get_wtime() - t0, total_vetoed() - vetoed );
+    }
+
+  // the last frame is written alone
+  if ( frame_open( frame[(frames - 1) % 2], pattern, frames - 1, ppm, patch ) )
+    return 1;
+ #pragma omp parallel for schedule(dynamic) if( background.n > 1 )
+  for ( int i = 0; i < background.n; i++ )
+    background.run( i );
+  frame_close();
+
+  return frame_out.failed;
+}
+
+int main ( int argc, char **argv)
+
+{
+  
+  unsigned int img_size[2] = { XSIZE_DFLT, YSIZE_DFLT };
+  unsigned int max_iter = MAX_ITER;
+  int init_patch = PATCH_SIDE_DEFAULT;
+  double viewport[4] = { X_MIN, X_MAX, Y_MIN, Y_MAX };
+  bool check_inside = false;
+  const char *outname = "mandelbrot.png";
+  int band_rows = 0;                        // 0 = the whole image
+  bool deep = false;
+  dd_t centre[2];
+  double radius = 0;
+  int frames = 1;                           // of the zoom animation
+  double zoom = 0.9;
+  bool named = false;
+
+  int opt;
+  while ( (opt = getopt( argc, argv, "v:po:b:z:e:a:" )) != -1 )
+    switch ( opt )
+      {
+      case 'a':
+	if ( (sscanf( optarg, "%d,%lf", &frames, &zoom ) < 1) || (frames < 1) || !(zoom > 0) ) {
+	  fprintf( stderr, "invalid animation \"%s\", expected frames[,zoom factor]\n", optarg );
+	  return 1; }
+	break;
+      case 'e':
+	{
+	  char name[16] = "";
+	  sscanf( optarg, "%15[^,],%d", name, &grainsize );
+	  engine = -1;
+	  for ( int e = 0; e < 3; e++ )
+	    if ( strcmp( name, engine_names[e] ) == 0 )
+	      engine = e;
+	  if ( (engine < 0) || (grainsize < 1) ) {
+	    fprintf( stderr, "invalid engine \"%s\", expected tasks, taskloop[,grainsize] or steal\n", optarg );
+	    return 1; }
+	}
+	break;
+      case 'z':
+	{
+	  const char *p = dd_parse( optarg, &centre[0] );
+	  const char *q = ( *p == ',' ? dd_parse( p + 1, &centre[1] ) : p );
+	  if ( (p == optarg) || (q == p + 1) || (*q != ',') || (sscanf( q + 1, "%lf", &radius ) != 1) || !(radius > 0) ) {
+	    fprintf( stderr, "invalid deep zoom \"%s\", expected re,im,radius\n", optarg );
+	    return 1; }
+	  deep = true;
+	}
+	break;
+      case 'b':
+	band_rows = atoi( optarg );
+	break;
+      case 'o':
+	outname = optarg;
+	named = true;
+	break;
+      case 'p':
+	check_inside = true;
+	break;
+      case 'v':
+	if ( (sscanf( optarg, "%lf,%lf,%lf,%lf", &viewport[0], &viewport[1], &viewport[2], &viewport[3] ) != 4) ||
+	     (viewport[0] >= viewport[1]) || (viewport[2] >= viewport[3]) ) {
+	  fprintf( stderr, "invalid viewport \"%s\", expected x_min,x_max,y_min,y_max\n", optarg );
+	  return 1; }
+	break;
+      default:
+	fprintf( stderr, "usage: %s [-v x_min,x_max,y_min,y_max | -z re,im,radius] [-p] [-o file] [-b rows] [-e engine] [-a frames[,zoom]] [x_size y_size [max_iter [patch [cutoff [depth]]]]]\n", argv[0] );
+	return 1;
+      }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ( argc > 2 )
+    {
+      img_size[0] = (unsigned int)atoi(*(argv+1));
+      img_size[1] = (unsigned int)atoi(*(argv+2));
+      if ( argc > 3 )
+	max_iter = (unsigned int)atoi(*(argv+3));
+
+      if ( argc > 4 )
+	init_patch = (int)atoi(*(argv+4));
+
+      if ( argc > 5 )
+	task_cutoff = atol(*(argv+5));
+
+      if ( argc > 6 )
+	max_task_depth = atoi(*(argv+6));
+      
+    }
+
+    if ( (init_patch <= 0) || (init_patch & (init_patch - 1)) ||
+	 (img_size[0] % init_patch) || (img_size[1] % init_patch) ) {
+      fprintf( stderr, "the patch size must be a power of 2 that divides the image sizes\n" );
+      return 1; }
+    const int ysize = (int)img_size[1];
+    if ( (band_rows <= 0) || (band_rows > ysize) )
+      band_rows = ysize;
+    if ( band_rows % init_patch ) {
+      fprintf( stderr, "the rows of a band must be a multiple of the patch size\n" );
+      return 1; }
+    if ( frames > 1 )
+      {
+	// one %d conversion in the name, for the frame number
+	if ( !named )
+	  outname = "mandelbrot_%04d.png";
+	const char *c = strchr( outname, '%' );
+	size_t      flags = ( c != NULL ? strspn( c + 1, "0123456789-+ #" ) : 0 );
+	if ( (c == NULL) || (c[1 + flags] != 'd') || (strchr( c + 2 + flags, '%' ) != NULL) ) {
+	  fprintf( stderr, "the name of the frames needs one %%d for the frame number, as in frame_%%04d.png\n" );
+	  return 1; }
+	if ( band_rows < ysize ) {
+	  fprintf( stderr, "the frames of an animation are rendered whole, -b does not apply\n" );
+	  return 1; }
+      }
+
+    size_t namelen = strlen( outname );
+    bool   ppm     = ( namelen > 4 ) && ( strcmp( outname + namelen - 4, ".ppm" ) == 0 );
+   #if !defined(NO_ZLIB)
+    bool   stream  = !ppm && (frames == 1);
+    png_stream_t W;
+   #else
+    bool   stream  = false;
+    if ( !ppm && (band_rows < ysize) ) {
+      fprintf( stderr, "without zlib, the image can be written in bands only as a .ppm\n" );
+      return 1; }
+   #endif
+    FILE  *ppm_file = NULL;
+
+    int nthreads = omp_get_max_threads();
+    stats = (thread_stats_t*)aligned_alloc( 64, nthreads * sizeof(thread_stats_t) );
+    if (!stats) {
+        perror("Failed to allocate the thread statistics");
+        return 1; }
+    memset( stats, 0, nthreads * sizeof(thread_stats_t) );
+
+    // the positions of the initial patches of a band, and the work queues
+    int *patch_pos = (int*)malloc( 2 * (size_t)(img_size[0] / init_patch) * (band_rows / init_patch) * sizeof(int) );
+    pool.deque = (deque_t*)aligned_alloc( 64, nthreads * sizeof(deque_t) );
+    if ( (patch_pos == NULL) || (pool.deque == NULL) ) {
+        perror("Failed to allocate the work queues");
+        return 1; }
+    for ( int t = 0; t < nthreads; t++ ) {
+      memset( &pool.deque[t], 0, sizeof(deque_t) );
+      omp_init_lock( &pool.deque[t].lock ); }
+
+  
+    if ( deep )
+      {
+	// the viewport is relative to the reference, with square pixels
+	double half_h = radius * img_size[1] / img_size[0];
+	viewport[0] = -radius;
+	viewport[1] =  radius;
+	viewport[2] = -half_h;
+	viewport[3] =  half_h;
+	if ( check_inside ) {
+	  fprintf( stderr, "-p does not apply to the deep zoom, ignored\n" );
+	  check_inside = false; }
+      }
+
+    // an animation writes a frame while computing the next one, in a second image
+    render_t R, R2;
+    if ( render_init( &R, img_size[0], img_size[1], band_rows, viewport, max_iter ) ||
+	 ((frames > 1) && render_init( &R2, img_size[0], img_size[1], band_rows, viewport, max_iter )) ) {
+        perror("Failed to allocate image memory");
+        return 1; }
+
+    printf("Calculating Mandelbrot set (%dx%d) with max %d iterations...\n", img_size[0], img_size[1], max_iter );
+    if ( deep )
+      {
+	double t0 = omp_get_wtime();
+	if ( ref_orbit_compute( centre[0], centre[1], max_iter ) ) {
+	  perror("Failed to allocate the reference orbit");
+	  return 1; }
+	printf("Deep zoom around (%.17g %+.3g, %.17g %+.3g), radius %g: reference orbit of %d iterations in %.4f s\n",
+	       centre[0].hi, centre[0].lo, centre[1].hi, centre[1].lo, radius, ref.len, omp_get_wtime() - t0 );
+      }
+    else
+      printf("Viewport: [%g, %g] x [%g, %g]\n", R.x_min, R.x_max, R.y_min, R.y_max );
+    printf("Using patch size: %d\n", init_patch );
+    if ( band_rows < ysize )
+      printf("Tiled: %d bands of %d rows in memory, %.1f MB\n", (ysize + band_rows - 1) / band_rows,
+	     band_rows, (double)band_rows * img_size[0] * sizeof(int) / (1024.0 * 1024.0) );
+    printf("Engine: %s", engine_names[engine] );
+    if ( engine == ENGINE_TASKLOOP )
+      printf(", grainsize %d", grainsize );
+    printf("; task cutoff: %ld estimated iterations, max task depth %d\n", task_cutoff, max_task_depth );
+    if ( frames > 1 )
+      printf("Animation: %d frames, zoom %g per frame, written to %s\n", frames, zoom, outname );
+    printf("Escape kernel: %s%s\n", select_kernel( getenv("MANDELBROT_ISA"), check_inside, deep ),
+	   ( deep ? ", perturbation" : check_inside ? ", with cardioid/bulb and periodicity checks" : "" ) );
+
+   #if !defined(NO_ZLIB)
+    if ( stream && png_stream_open( &W, &R, outname, init_patch, img_size[0] / init_patch ) )
+      return 1;
+    png_out = ( stream ? &W : NULL );
+   #endif
+    if ( ppm && (frames == 1) && ((ppm_file = ppm_open( outname, img_size[0], img_size[1] )) == NULL) )
+      return 1;
+
+    printf("Running with %d OpenMP threads.\n", nthreads);
+    double start_time = omp_get_wtime();
+    run_start = start_time;
+    double ppm_time   = 0;
+    int    failed     = 0;
+
+    // the image is rendered one band at a time: a PNG band is written as
+    // soon as it is done, a PPM band after the whole band
+    if ( frames > 1 )
+      failed = render_animation( &R, &R2, init_patch, patch_pos, frames, zoom, outname, ppm );
+    else
+      for ( int y0 = 0; y0 < ysize; y0 += band_rows )
+	{
+	  render_band( &R, y0 );
+	  render_patches( &R, init_patch, patch_pos );
+
+	  if ( ppm )
+	    {
+	      double t0 = omp_get_wtime();
+	      failed |= ppm_write_band( &R, ppm_file );
+	      ppm_time += omp_get_wtime() - t0;
+	    }
+	}
+
+    double end_time = omp_get_wtime();
+    double pixels   = (double)R.xsize * R.ysize * frames;
+    printf("Calculation finished in %.4f seconds.\n", end_time - start_time);
+    if ( frames > 1 )
+      printf("%d frames, %.2f frames/s, writing included\n", frames, frames / (end_time - start_time) );
+
+    // --- task statistics
+    long   tot_tasks = 0, tot_inline = 0, tot_events = 0;
+    long   tot_computed = 0, tot_reused = 0;
+    double tot_busy  = 0, max_busy   = 0;
+    for ( int t = 0; t < nthreads; t++ )
+      {
+	tot_tasks  += stats[t].ntasks;
+	tot_inline += stats[t].ninline;
+	tot_busy   += stats[t].busy;
+	tot_events += stats[t].events;
+	tot_computed += stats[t].computed;
+	tot_reused   += stats[t].reused;
+	max_busy    = ( stats[t].busy > max_busy ? stats[t].busy : max_busy );
+      }
+    printf("Patches: %ld as tasks, %ld inline\n", tot_tasks, tot_inline );
+    for ( int t = 0; t < nthreads; t++ )
+      printf("   thread %3d: %9ld tasks, %9ld inline, %7ld stolen, first at %.4f s, busy %.4f s (%.1f%%)\n",
+	     t, stats[t].ntasks, stats[t].ninline, stats[t].steals, stats[t].first, stats[t].busy,
+	     100.0 * stats[t].busy / (end_time - start_time) );
+    if ( tot_busy > 0 )
+      {
+	printf("Load imbalance (max/average busy time): %.3f\n", max_busy / (tot_busy / nthreads) );
+	print_histogram( nthreads, end_time - start_time );
+      }
+    printf("Points evaluated: %ld (%.1f%% of the pixels), border points reused: %ld\n",
+	   tot_computed, 100.0 * tot_computed / pixels, tot_reused );
+    if ( frames > 1 )
+      printf("Uniform fills vetoed by the hints of the previous frames: %ld\n", total_vetoed() );
+    if ( deep )
+      printf("Rebases on the reference orbit: %ld (%.2f per point evaluated)\n",
+	     tot_events, (double)tot_events / tot_computed );
+    else if ( check_inside )
+      printf("Iterations saved by the fast path: %ld (%.1f per pixel)\n",
+	     tot_events, (double)tot_events / pixels );
+
+    if ( frames > 1 )
+      {
+	// every frame has been written while computing the next one
+	if ( !ppm )
+	  printf("Frames written to %s, %zu bytes, %.4f s of encoding over the threads\n",
+		 outname, frame_out.bytes, frame_out.encode_time );
+	else
+	  printf("Frames written to %s\n", outname );
+      }
+    else
+      {
+	printf("Saving image to %s...\n", outname);
+       #if !defined(NO_ZLIB)
+	if ( stream )
+	  {
+	    // the bands are written while computing; what is left is the last ones
+	    failed = png_stream_close( &W );
+	    printf("PNG written in %d bands, %zu bytes, %.4f s of encoding over the threads\n",
+		   W.nbands, W.bytes, W.encode_time );
+	  }
+       #endif
+	if ( ppm )
+	  {
+	    failed |= ( fclose( ppm_file ) != 0 );
+	    if ( failed )
+	      fprintf( stderr, "ERROR: could not write PPM file %s\n", outname );
+	    printf("PPM written in %.4f seconds, band by band\n", ppm_time );
+	  }
+	else if ( !stream )
+	  save_to_png(R.image, R.xsize, R.ysize, outname);
+      }
+    double done_time = omp_get_wtime();
+    printf("Done in %.4f seconds after the calculation.\n", done_time - end_time);
+
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    printf("Throughput: %.1f Mpixel/s; peak RSS %.1f MB\n",
+	   pixels / (done_time - start_time) * 1e-6, usage.ru_maxrss / 1024.0 );
 
-    free(image);
-    return 0;
+    render_release( &R );
+    if ( frames > 1 )
+      render_release( &R2 );
+    ref_orbit_release();
+    for ( int t = 0; t < nthreads; t++ ) {
+      omp_destroy_lock( &pool.deque[t].lock );
+      free( pool.deque[t].items ); }
+    free( pool.deque );
+    free( patch_pos );
+    free(stats);
+    return failed;
 }
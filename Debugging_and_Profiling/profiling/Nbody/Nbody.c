@@ -5,93 +5,125 @@
  * This program simulates the interaction of N bodies under gravity.
  * It's designed to highlight performance differences based on data layout.
  *
- * Two data layouts are implemented, switchable at compile time:
+ * Four data layouts are implemented, switchable at compile time:
  * 1. Array of Structs (AoS): The default, intuitive, but cache-unfriendly layout.
  * 2. Struct of Arrays (SoA): A more performant, cache-friendly layout.
+ * 3. Array of Structs of Arrays (AoSoA): blocks of AOSOA_W (8) particles,
+ *    each field being a short vector inside the block; as cache-friendly as
+ *    SoA, with a single memory stream instead of ten.
+ * 4. Hot/cold split: position and mass, the only fields the pair loop reads,
+ *    packed in a 32-bytes record; velocities and forces in two other arrays
+ *    (the lesson of ex_3__hot_and_cold_fields applied to this kernel).
+ * The serial kernels are written once for all of them (nbody_kernels.h).
  *
  * --- How to Compile & Run ---
  *
  * For the slow, cache-unfriendly version (AoS):
- * gcc -g -O3 -o nbody_aos nbody_simulation.c -lm
+ * gcc -g -O3 -fopenmp -o nbody_aos Nbody.c nbody_*.c -lm
  *
  * For the fast, cache-friendly version (SoA):
- * gcc -g -O3 -DUSE_SOA -o nbody_soa nbody_simulation.c -lm
+ * gcc -g -O3 -fopenmp -DUSE_SOA -o nbody_soa Nbody.c nbody_*.c -lm
+ *
+ * For the blocked version (AoSoA):
+ * gcc -g -O3 -fopenmp -DUSE_AOSOA -o nbody_aosoa Nbody.c nbody_*.c -lm
+ *
+ * For the hot/cold split version:
+ * gcc -g -O3 -fopenmp -DUSE_SPLIT -o nbody_split Nbody.c nbody_*.c -lm
  *
  * The -g flag includes debug symbols for profiling.
  * The -O3 flag is important to enable vectorization and other optimizations,
  * which makes the performance gap between AoS and SoA even more significant.
  * The -lm flag links the math library for sqrt().
+ * The -fno-math-errno flag tells the compiler that sqrt() does not need to
+ * set errno (it is never called on a negative number), which is needed to
+ * vectorize it; the mixed-precision engine (-f mixed) relies on it.
+ * The -fopenmp flag is needed only by the multi-threaded engine (-f omp)
+ * and by the parallel initialization; without it they still work, on a
+ * single thread. The initial conditions are a function of the seed only,
+ * and are the same whatever the number of threads.
+ * The force and the update phases are timed, and counted, separately:
+ * rate, GFLOP/s, bytes per interaction (per particle for the update), IPC
+ * and the arithmetic intensity, i.e. the point of the phase on a roofline.
+ * The hardware counters come from PAPI with -DUSE_PAPI (and -lpapi), for
+ * the master thread only, otherwise from perf_event_open() on Linux, for
+ * all the threads (-DNO_PERF to do without); the bytes are then measured
+ * from the cache misses instead of being estimated.
+ *
+ * ./nbody [options] [N] [Nsteps] [seed]
+ *
+ *  -f direct|tree|omp|simd[=avx512|avx2|scalar]|mixed|cells
+ *                  force engine (default: direct, the O(N^2) reference);
+ *                  omp is the multi-threaded direct summation, simd the
+ *                  hand-vectorized one (SoA only), by default on the best
+ *                  instruction set found at run-time, mixed the one with
+ *                  the pair interactions in float and the sums in double;
+ *                  cells computes only the short-range forces, on a cell list
+ *  -x rc           cutoff radius for the cell list (default 0.1)
+ *  -t theta        opening angle for the tree (default 0.5)
+ *  -e K            check the forces against the direct summation every K
+ *                  steps (default: only at the first step, 0 = never); for
+ *                  the cell list, against the one with the same cutoff
+ *  -s n            number of particles sampled for the check (default 1000)
+ *  -i euler|kdk    integrator: Euler with a global timestep (default), or
+ *                  kick-drift-kick leapfrog with individual block timesteps
+ *                  (then every step is a big step of dt, made of sub-steps;
+ *                  the active particles get their forces from the tree with
+ *                  -f tree, from the cell list with -f cells, from the
+ *                  direct summation otherwise, and -f mixed is not available)
+ *  -a eta          accuracy parameter of the individual timesteps (default 0.02)
+ *  -r K            sort the particles along a Morton curve every K steps
+ *                  (default 0, never); the first step always runs unsorted,
+ *                  as a reference for the cache misses
+ *  -m K            monitor the drift of energy, momentum and angular momentum
+ *                  every K steps (default 0: only at the beginning and at
+ *                  the end); with the direct engines and the Euler
+ *                  integrator the potential energy comes from the force pass
+ *  -d file         also write the measures to file, as a binary time series
+ *  -c K            write a checkpoint every K steps, and at the end
+ *  -o file         name of the checkpoint file (default nbody.ckpt)
+ *  -R file         restart from a checkpoint: N and the seed are taken from
+ *                  it, and the run goes on from its step up to Nsteps
+ *  -L n            before the evolution, compare the four layouts on n
+ *                  force computations of the same initial conditions
+ *  -p              pin the threads to the cores, so that the particles
+ *                  stay on the NUMA node of the thread that initialized them
+ *  -n              replicate the positions and masses read by the
+ *                  mixed-precision engine on every NUMA node
  */
 
 
-#define _XOPEN_SOURCE 700
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-#include <time.h>
-#include <math.h>
-
-#define CPU_TIME ({struct  timespec ts; clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts ), \
-                                          (double)ts.tv_sec +           \
-                                          (double)ts.tv_nsec * 1e-9;})
+#include <unistd.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
-#define NP_dflt 2048
-#define NSTEPS_dflt 100
-#define G 6.67430e-11 // Gravitational constant
-#define DT 0.01       // Time step
+#include "Nbody.h"
+#include "mypapi.h"
 
 // Epsilon to avoid division by zero when bodies are at the same position.
 const double epsilon_sq = 1e-9;
 
-#ifdef USE_SOA
-// --- Struct of Arrays (SoA) Layout ---
-// Cache-friendly for this problem
-typedef struct {
-    double* x, * y, * z;
-    double* vx, * vy, * vz;
-    double* mass;
-    double* fx, * fy, * fz; // Forces
-} particle_t;
-
-#else
-// --- Array of Structs (AoS) Layout ---
-// Cache-unfriendly for this problem
-typedef struct {
-    double x, y, z;
-    double vx, vy, vz;
-    double mass;
-    double fx, fy, fz; // Forces
-} particle_t;
-#endif
-
-
-#ifdef USE_SOA
-void initialize_particles ( particle_t *, const size_t N );
-#else
-void initialize_particles ( particle_t **, const size_t N );
-#endif
-void compute_forces       ( particle_t * restrict, const size_t );
-void update_particles     ( particle_t *, size_t, double );
-
-
-
 
 
 /**
  * @brief Initializes the bodies with random positions and masses.
+ * Particle i takes the random numbers 4i .. 4i+3 of the stream "seed", so
+ * that the initial conditions depend only on the seed: not on the number
+ * of threads, nor on the order in which the particles are initialized.
+ * Every field is written by the same thread that will work on the particle
+ * in the static loops, so that with first-touch placement the memory pages
+ * end up on its NUMA node; that is why the memory is not cleared with a
+ * memset() right after the allocation.
  */
 
-#ifdef USE_SOA
-void initialize_particles ( particle_t * P, const size_t N )
+#ifdef LAYOUT_ARRAYS
+void initialize_particles ( particle_t * P, const size_t N, const long seed )
 #else
-void initialize_particles ( particle_t ** _P, const size_t N )
+void initialize_particles ( particle_t ** _P, const size_t N, const long seed )
 #endif
 {
- #ifdef USE_SOA
+ #if defined(USE_SOA)
   P->x = (double*)malloc(N * 10 * sizeof(double));
-  memset ( P->x, 0, N * 10 * sizeof(double) );
 
   P->y    = P->x + N;
   P->z    = P->x + 2*N;
@@ -103,165 +135,170 @@ void initialize_particles ( particle_t ** _P, const size_t N )
   P->fy   = P->x + 8*N;
   P->fz   = P->x + 9*N;
   
+ #elif defined(USE_SPLIT)
+  P->hot = (particle_hot_t*)malloc( N * PARTICLE_BYTES );
+
+  P->vel   = (particle_vel_t*)( P->hot + N );
+  P->force = (particle_force_t*)( P->vel + N );
+
+ #elif defined(USE_AOSOA)
+
+  // the last block is padded; the padding particles are never accessed
+  particle_t *P = (particle_t*)aligned_alloc( 64, AOSOA_NBLOCKS(N) * sizeof(particle_t) );
+  *_P = P;
+  if ( P != NULL )
+    for ( size_t i = N; i < AOSOA_NBLOCKS(N) * AOSOA_W; i++ ) {
+      PX(P,i)  = PY(P,i)  = PZ(P,i)  = PM(P,i)  = 0;
+      PVX(P,i) = PVY(P,i) = PVZ(P,i) = 0;
+      PFX(P,i) = PFY(P,i) = PFZ(P,i) = 0; }
+
  #else
 
   particle_t *P = (particle_t*)malloc( N * sizeof(particle_t) );
   *_P = P;  
-  memset ( P, 0, N * sizeof(particle_t) );
   
  #endif
+
+ #if defined(USE_SOA)
+  if ( P->x == NULL ) {
+ #elif defined(USE_SPLIT)
+  if ( P->hot == NULL ) {
+ #else
+  if ( P == NULL ) {
+ #endif
+    fprintf( stderr, "unable to allocate %llu particles\n", (unsigned long long)N );
+    exit( 1 ); }
   
-  // Use a fixed seed for reproducibility
-  
+ #pragma omp parallel for schedule(static)
   for ( size_t i = 0; i < N; i++)
     {
-      double a = (double)drand48();
-      double b = (double)drand48();
-      double c = (double)drand48();
-      double d = (double)drand48();
-
-     #ifdef USE_SOA
-      
-      P->x[i] = a;
-      P->y[i] = b;
-      P->z[i] = c;
-      P->mass[i] = d * 1e12 + 1e11;
-      
-     #else
-
-      P[i].x = a;
-      P[i].y = b;
-      P[i].z = c;
-      P[i].mass = d * 1e12 + 1e11;
-      
-     #endif
-
+      double a = rng_uniform( seed, 4*i );
+      double b = rng_uniform( seed, 4*i + 1 );
+      double c = rng_uniform( seed, 4*i + 2 );
+      double d = rng_uniform( seed, 4*i + 3 );
+
+      PX(P,i) = a;
+      PY(P,i) = b;
+      PZ(P,i) = c;
+      PM(P,i) = d * 1e12 + 1e11;
+
+      PVX(P,i) = PVY(P,i) = PVZ(P,i) = 0;
+      PFX(P,i) = PFY(P,i) = PFZ(P,i) = 0;
     }
 }
 
 
+// compute_forces() and update_particles() for the compiled layout
+//
+#define KTYPE    particle_t
+#define KFIELD   PFIELD
+#define KSUFFIX
+#define KSTORAGE
+#include "nbody_kernels.h"
+
+  
 /**
- * @brief The core computational kernel. Calculates the gravitational forces.
- * This is where the O(N^2) complexity lies and where the performance
- * difference between AoS and SoA is most apparent.
+ * @brief Checks the forces currently stored in P against the direct summation.
+ * The exact force is computed for nsample particles only, evenly spaced in
+ * the storage order, so that the check costs O(nsample * N).
+ * With rc > 0 the reference is the sum with the same cutoff and switch as
+ * the cell list, which then checks the cells, not the cutoff.
+ * @return the rms relative error; the max relative error is in *max_err
  */
 
-void compute_forces ( particle_t * restrict P, const size_t N )
+double force_error ( particle_t * restrict P, const size_t N, const size_t nsample,
+		     const double rc, double *max_err )
 {
-  
- #ifdef USE_SOA
-  for ( size_t i = 0; i < N; i++)
-    P->fx[i] = P->fy[i] = P->fz[i] = 0.0;
- #else
-  for ( size_t i = 0; i < N; i++)
-    P[i].fx = P[i].fy = P[i].fz = 0.0;
- #endif
+  size_t ns     = ( nsample < N ? nsample : N );
+  size_t stride = ( ns > 0 ? N / ns : 1 );
+  double sum    = 0;
+  double max    = 0;
 
-  
-  for ( size_t i = 0; i < N; i++ )
-    {            
-     #ifdef USE_SOA
-      const double x = P->x[i];
-      const double y = P->y[i];
-      const double z = P->z[i];
-      const double mG = P->mass[i]*G;
-     #else
-      const double x = P[i].x;
-      const double y = P[i].y;
-      const double z = P[i].z;
-      const double mG = P[i].mass*G;
-     #endif
+  for ( size_t s = 0; s < ns; s++ )
+    {
+      size_t i = s * stride;
+      const double x  = PX(P,i);
+      const double y  = PY(P,i);
+      const double z  = PZ(P,i);
+      const double mG = PM(P,i)*G;
 
       double fx = 0;
       double fy = 0;
       double fz = 0;
-      
-      
-      for (size_t j = i + 1; j < N; j++)
+
+      for ( size_t j = 0; j < N; j++ )
 	{
-	 #ifdef USE_SOA
-	  double dx = P->x[j] - x;
-	  double dy = P->y[j] - y;
-	  double dz = P->z[j] - z;
-	 #else
-	  double dx = P[j].x - x;
-	  double dy = P[j].y - y;
-	  double dz = P[j].z - z;
-	 #endif
-	  
+	  if ( j == i )
+	    continue;
+	  double dx = PX(P,j) - x;
+	  double dy = PY(P,j) - y;
+	  double dz = PZ(P,j) - z;
 	  double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
 	  double inv_dist = 1.0 / sqrt(dist_sq);
-	  double inv_dist_cubed = inv_dist * inv_dist * inv_dist;
-
-	 #ifdef USE_SOA
-	  double force_mag = mG * P->mass[j] * inv_dist_cubed;
-	 #else
-	  double force_mag = mG * P[j].mass * inv_dist_cubed;
-	 #endif
-	  
-	  double _fx = force_mag * dx;
-	  double _fy = force_mag * dy;
-	  double _fz = force_mag * dz;
-	  
-	  fx += _fx;
-	  fy += _fy;
-	  fz += _fz;
-	  
-	 #ifdef USE_SOA
-	  P->fx[j] -= _fx;
-	  P->fy[j] -= _fy;
-	  P->fz[j] -= _fz;
-	 #else
-	  P[j].fx -= _fx;
-	  P[j].fy -= _fy;
-	  P[j].fz -= _fz;
-	 #endif
+	  double force_mag = mG * PM(P,j) * inv_dist * inv_dist * inv_dist;
+	  if ( rc > 0 )
+	    force_mag *= cutoff_switch( dist_sq - epsilon_sq, rc * rc );
+	  fx += force_mag * dx;
+	  fy += force_mag * dy;
+	  fz += force_mag * dz;
 	}
+
+      double ex = PFX(P,i) - fx;
+      double ey = PFY(P,i) - fy;
+      double ez = PFZ(P,i) - fz;
+      double f2 = fx*fx + fy*fy + fz*fz;
+      double err = ( f2 > 0 ? sqrt( (ex*ex + ey*ey + ez*ez) / f2 ) : 0 );
+      sum += err * err;
+      max  = ( err > max ? err : max );
     }
+
+  if ( max_err != NULL )
+    *max_err = max;
+  return ( ns > 0 ? sqrt( sum / ns ) : 0 );
 }
-  
+
+
 /**
- * @brief Updates the velocities and positions of all bodies based on the
- * computed forces using a simple Euler integration step.
+ * @brief Reports a phase of the step loop: nunits (interactions, particle
+ * updates) done in wtime seconds, flops_per_unit each, moving bytes_est
+ * bytes each by estimate (0 if unknown). cntr are the counters of the phase
+ * (instructions, cycles, L1 and L2 or last-level misses), NULL if none:
+ * the bytes are then measured as 64 per L2 (last-level) miss, i.e. those
+ * coming from the next level, which is what the roofline is drawn against.
  */
+static void phase_report ( const char *name, const double wtime, const double nunits,
+			   const char *unit, const double flops_per_unit, const double bytes_est,
+			   const unsigned long long *cntr )
+{
+  printf("%s: %g s", name, wtime );
+  if ( (nunits > 0) && (wtime > 0) )
+    printf(", %g G%ss/s, %g GFLOP/s", nunits / wtime * 1e-9, unit,
+	   flops_per_unit * nunits / wtime * 1e-9 );
+  if ( (cntr != NULL) && (cntr[1] > 0) )
+    printf(", IPC %.2f", (double)cntr[0] / cntr[1] );
+  printf("\n");
+  if ( (nunits <= 0) || (wtime <= 0) )
+    return;
 
-void update_particles ( particle_t* P, size_t N, double dt )
-  {
-    for (int i = 0; i < N; i++)
-      {
-	
-       #ifdef USE_SOA
-	
-	double mass_r = 1.0 / P->mass[i];
-	
-	// Update velocity
-	P->vx[i] += P->fx[i] / mass_r * dt;
-	P->vy[i] += P->fy[i] / mass_r * dt;
-	P->vz[i] += P->fz[i] / mass_r * dt;
-	
-	// Update position
-	P->x[i] += P->vx[i] * dt;
-	P->y[i] += P->vy[i] * dt;
-	P->z[i] += P->vz[i] * dt;
-
-	#else
-
-	double mass_r = 1.0 / P[i].mass;
-	
-        // Update velocity
-        P[i].vx += P[i].fx / mass_r * dt;
-        P[i].vy += P[i].fy / mass_r * dt;
-        P[i].vz += P[i].fz / mass_r * dt;
-
-        // Update position
-        P[i].x += P[i].vx * dt;
-        P[i].y += P[i].vy * dt;
-        P[i].z += P[i].vz * dt;
-	
-       #endif
-      }
+  double bytes = bytes_est;
+  if ( cntr != NULL )
+    {
+      bytes = 64.0 * cntr[3] / nunits;
+      printf("   %g bytes/%s from L2, %g from %s (measured, %s; %g estimated)\n",
+	     64.0 * cntr[2] / nunits, unit, bytes,
+	    #if defined(HAVE_COUNTERS)
+	     (strcmp( CNTR_LL_NAME, "L2" ) == 0 ? "L3 or memory" : "memory"), COUNTERS_SCOPE,
+	    #else
+	     "memory", "",
+	    #endif
+	     bytes_est );
+    }
+  else if ( bytes_est > 0 )
+    printf("   %g bytes/%s (estimated)\n", bytes_est, unit );
 
-    return;
+  if ( bytes > 0 )
+    printf("   roofline: arithmetic intensity %g flop/byte at %g GFLOP/s\n",
+	   flops_per_unit / bytes, flops_per_unit * nunits / wtime * 1e-9 );
 }
 
 
@@ -269,68 +306,429 @@ int main ( int argc, char **argv )
 
 {
   double dt = 0.1;
+  int    engine  = FORCE_DIRECT;
+  double theta   = THETA_dflt;
+  double rcut    = RCUT_dflt;
+  int    check_every = -1;
+  size_t nsample = 1000;
+  char  *isa     = NULL;
+  int    integrator = INTEGRATOR_EULER;
+  double eta     = ETA_dflt;
+  int    reorder_every = 0;
+  int    layout_reps   = 0;
+  int    monitor_every = 0;
+  char  *series_name   = NULL;
+  int    ckpt_every    = 0;
+  char  *ckpt_name     = "nbody.ckpt";
+  char  *restart_name  = NULL;
+  int    pin_threads   = 0;
+  int    replicate     = 0;
+
+  int c;
+  while ( (c = getopt(argc, argv, "f:t:x:e:s:i:a:r:m:d:c:o:R:L:pn")) != -1 )
+    switch ( c )
+      {
+      case 'f':
+	if ( strcmp( optarg, "direct" ) == 0 )
+	  engine = FORCE_DIRECT;
+	else if ( strcmp( optarg, "tree" ) == 0 )
+	  engine = FORCE_TREE;
+	else if ( strcmp( optarg, "omp" ) == 0 )
+	  engine = FORCE_OMP;
+	else if ( strncmp( optarg, "simd", 4 ) == 0 ) {
+	  engine = FORCE_SIMD;
+	  isa = ( optarg[4] == '=' ? optarg+5 : NULL ); }
+	else if ( strcmp( optarg, "mixed" ) == 0 )
+	  engine = FORCE_MIXED;
+	else if ( strcmp( optarg, "cells" ) == 0 )
+	  engine = FORCE_CELLS;
+	else {
+	  printf("unknown force engine \"%s\"\n", optarg );
+	  return 1; }
+	break;
+
+      case 't':
+	theta = atof(optarg); break;
+
+      case 'x':
+	rcut = atof(optarg); break;
+
+      case 'e':
+	check_every = atoi(optarg); break;
+
+      case 's':
+	nsample = (size_t)atoll(optarg); break;
+
+      case 'i':
+	if ( strcmp( optarg, "euler" ) == 0 )
+	  integrator = INTEGRATOR_EULER;
+	else if ( strcmp( optarg, "kdk" ) == 0 )
+	  integrator = INTEGRATOR_KDK;
+	else {
+	  printf("unknown integrator \"%s\"\n", optarg );
+	  return 1; }
+	break;
+
+      case 'a':
+	eta = atof(optarg); break;
+
+      case 'r':
+	reorder_every = atoi(optarg); break;
+
+      case 'm':
+	monitor_every = atoi(optarg); break;
+
+      case 'd':
+	series_name = optarg; break;
+
+      case 'c':
+	ckpt_every = atoi(optarg); break;
+
+      case 'o':
+	ckpt_name = optarg; break;
+
+      case 'R':
+	restart_name = optarg; break;
+
+      case 'L':
+	layout_reps = atoi(optarg); break;
+
+      case 'p':
+	pin_threads = 1; break;
+
+      case 'n':
+	replicate = 1; break;
+
+      default :
+	printf("argument -%c not known\n", c ); return 1;
+      }
+
+  // the sub-steps of the leapfrog need the forces on the active particles
+  // only, which the tree and the direct summation give
+  if ( (integrator == INTEGRATOR_KDK) && (engine == FORCE_MIXED) ) {
+    printf("the mixed-precision engine has no active-particle path, it can not be used with -i kdk\n" );
+    return 1; }
+
+  argc -= optind-1;
+  argv += optind-1;
+
   size_t N      = (argc > 1 ? atoll(*(argv+1)) : NP_dflt );
   size_t Nsteps = (argc > 2 ? atoll(*(argv+2)) : NSTEPS_dflt );
   long int seed = (argc > 3 ? atol(*(argv+3)) : 0 );
   if ( seed == 0 )
     seed = time(NULL);
 
-  srand ( seed );
-  
+  long   step0 = 0;
+  double time0 = 0;
+  if ( (restart_name != NULL) &&
+       (checkpoint_info( restart_name, &N, &step0, &time0, &seed ) != 0) )
+    return 1;
+  if ( Nsteps < (size_t)step0 )
+    Nsteps = step0;
+
   printf ( " »»» N-Body toy simulator\n"
 	   " using %s\n"
 	   " \t %llu particles\n",
-	  #ifdef USE_SOA
-	   "Structures of Arrays",
-	  #else
-	   "Arrays of structures",
-	  #endif
-	   (unsigned long long)N );
-
-  double timing_init = CPU_TIME;
-
- #ifdef USE_SOA
+	   LAYOUT_NAME, (unsigned long long)N );
+
+  if ( engine == FORCE_TREE )
+    printf ( " \t Barnes-Hut tree, opening angle %g\n", theta );
+  else if ( engine == FORCE_OMP )
+    printf ( " \t multi-threaded direct summation, %d threads\n",
+	    #if defined(_OPENMP)
+	     omp_get_max_threads()
+	    #else
+	     1
+	    #endif
+	     );
+  else if ( engine == FORCE_SIMD )
+    printf ( " \t vectorized direct summation, %s kernel\n",
+	     simd_name( simd_select( isa ) ) );
+  else if ( engine == FORCE_MIXED )
+    printf ( " \t mixed-precision direct summation%s\n",
+	     (replicate ? ", positions replicated per NUMA node" : "") );
+  else if ( engine == FORCE_CELLS )
+    printf ( " \t cell list, cutoff radius %g\n", rcut );
+  else
+    printf ( " \t direct summation\n" );
+
+  if ( integrator == INTEGRATOR_KDK )
+    printf ( " \t KDK leapfrog, block timesteps, eta %g\n", eta );
+  if ( reorder_every > 0 )
+    printf ( " \t Morton reordering every %d steps\n", reorder_every );
+  if ( restart_name != NULL )
+    printf ( " \t restarting from %s, step %ld, time %g\n", restart_name, step0, time0 );
+  if ( ckpt_every > 0 )
+    printf ( " \t checkpoint to %s every %d steps\n", ckpt_name, ckpt_every );
+
+  // before the particles are allocated and first touched
+  numa_setup( pin_threads );
+  numa_report();
+
+  PAPI_INIT;
+
+  double timing_init  = CPU_TIME;
+  double wtiming_init = WALL_TIME;
+
+ #ifdef LAYOUT_ARRAYS
   particle_t P;  
+  particle_t *PP = &P;
  #else  
   particle_t *P = NULL;
  #endif
   
-  initialize_particles( &P, N );
-  
-  timing_init = CPU_TIME - timing_init;
+  initialize_particles( &P, N, seed );
+ #ifndef LAYOUT_ARRAYS
+  particle_t *PP = P;
+ #endif
+  if ( (restart_name != NULL) && (checkpoint_read( restart_name, PP, N ) != 0) )
+    return 1;
   
+  timing_init  = CPU_TIME - timing_init;
+  wtiming_init = WALL_TIME - wtiming_init;
+
+  if ( layout_reps > 0 )
+    layout_benchmark( PP, N, layout_reps );
+
+  if ( (series_name != NULL) && (diag_open( series_name, N ) != 0) )
+    return 1;
+
+  // the direct engines can give the potential energy along with the forces
+  const int fused_diag = ( (integrator == INTEGRATOR_EULER) &&
+			   ((engine == FORCE_DIRECT) || (engine == FORCE_OMP)) );
+
 
   printf("Starting simulation for %llu bodies over %lu timesteps...\n",
-	 (unsigned long long)N, Nsteps );
+	 (unsigned long long)N, Nsteps - step0 );
 
   double timing_evolution = CPU_TIME;
+  double wtiming_evolution = WALL_TIME;
+  double timing_check     = 0;
+  double wtiming_check    = 0;
+  double wtiming_forces   = 0;
+
+  // force phase with the particles unsorted [0] and sorted [1], and reordering
+  int    sorted             = 0;
+  int    nsteps_phase[2]    = {0};
+  double wtiming_phase[2]   = {0};
+  int    nreorder           = 0;
+  double wtiming_reorder    = 0;
+  double wtiming_update    = 0;
+ #if defined(HAVE_COUNTERS)
+  uLint  papi_phase[2][PAPI_EVENTS_NUM] = {0};
+  uLint  papi_reorder[PAPI_EVENTS_NUM]  = {0};
+  uLint  papi_update[PAPI_EVENTS_NUM]   = {0};
+ #endif
   
-  for (int step = 0; step < Nsteps; step++ )
+  for (int step = step0; step < Nsteps; step++ )
     {
-     #ifdef USE_SOA
-      compute_forces( &P, N );
-      update_particles( &P, N, dt );
-     #else
-      compute_forces( P, N );
-      update_particles( P, N, dt );
-     #endif
+      const int measure = ( (step == step0) ||
+			    ((monitor_every > 0) && (step % monitor_every == 0)) );
+      double    U       = 0;
+
+      if ( (reorder_every > 0) && (step > 0) && (step % reorder_every == 0) )
+	{
+	  double wtstart = WALL_TIME;
+	  PAPI_FLUSH;
+	  PAPI_START_CNTR;
+	  const size_t *perm = sfc_reorder( PP, N );
+	  PAPI_STOP_CNTR;
+	  PAPI_ACC_CNTR( papi_reorder );
+	  if ( integrator == INTEGRATOR_KDK )
+	    leapfrog_permute( perm, N );
+	  cells_invalidate();
+	  wtiming_reorder += WALL_TIME - wtstart;
+	  nreorder++;
+	  sorted = 1;
+	}
+
+      // the state at the beginning of the step, before leapfrog_step() moves
+      // it; only the Euler direct engines give U along with the forces
+      if ( measure && !fused_diag )
+	{
+	  double tstart  = CPU_TIME;
+	  double wtstart = WALL_TIME;
+	  diag_monitor( PP, N, step, step * dt );
+	  timing_check  += CPU_TIME - tstart;
+	  wtiming_check += WALL_TIME - wtstart;
+	}
+
+      double wtstart = WALL_TIME;
+      PAPI_FLUSH;
+      PAPI_START_CNTR;
+      if ( integrator == INTEGRATOR_KDK )
+	// forces, kicks and drifts are interleaved in the sub-steps
+	leapfrog_step( PP, N, dt, eta, engine, theta, rcut );
+      else
+	switch ( engine )
+	  {
+	  case FORCE_TREE: compute_forces_tree( PP, N, theta ); break;
+	  case FORCE_OMP :
+	    if ( measure && fused_diag )
+	      U = compute_forces_omp_potential( PP, N );
+	    else
+	      compute_forces_omp( PP, N );
+	    break;
+	  case FORCE_SIMD: compute_forces_simd( PP, N ); break;
+	  case FORCE_MIXED: compute_forces_mixed( PP, N, replicate ); break;
+	  case FORCE_CELLS: compute_forces_cells( PP, N, rcut ); break;
+	  default        :
+	    if ( measure && fused_diag )
+	      U = compute_forces_potential( PP, N );
+	    else
+	      compute_forces( PP, N );
+	    break;
+	  }
+      PAPI_STOP_CNTR;
+      PAPI_ACC_CNTR( papi_phase[sorted] );
+      wtiming_forces += WALL_TIME - wtstart;
+      wtiming_phase[sorted] += WALL_TIME - wtstart;
+      nsteps_phase[sorted]++;
+
+      if ( (engine != FORCE_DIRECT) &&
+	   ( (check_every < 0 && step == step0) ||
+	     (check_every > 0 && step % check_every == 0) ) )
+	{
+	  double tstart  = CPU_TIME;
+	  double wtstart = WALL_TIME;
+	  double max_err;
+	  double rms_err = force_error( PP, N, nsample, (engine == FORCE_CELLS ? rcut : 0), &max_err );
+	  printf("step %d : force error vs direct summation%s: rms %g, max %g\n",
+		 step, (engine == FORCE_CELLS ? " with the same cutoff" : ""), rms_err, max_err );
+	  timing_check  += CPU_TIME - tstart;
+	  wtiming_check += WALL_TIME - wtstart;
+	}
+
+      // Euler: positions and velocities are still those of the beginning of
+      // the step
+      if ( measure && fused_diag )
+	{
+	  double tstart  = CPU_TIME;
+	  double wtstart = WALL_TIME;
+	  diag_monitor_potential( PP, N, step, step * dt, U );
+	  timing_check  += CPU_TIME - tstart;
+	  wtiming_check += WALL_TIME - wtstart;
+	}
+
+      if ( integrator == INTEGRATOR_EULER )
+	{
+	  double wtstart = WALL_TIME;
+	  PAPI_FLUSH;
+	  PAPI_START_CNTR;
+	  update_particles( PP, N, dt );
+	  PAPI_STOP_CNTR;
+	  PAPI_ACC_CNTR( papi_update );
+	  wtiming_update += WALL_TIME - wtstart;
+	}
+
+      // the checkpoint is written in the background, the loop goes on
+      if ( (ckpt_every > 0) && ((step+1) % ckpt_every == 0) )
+	checkpoint_write( PP, N, step+1, (step+1) * dt, seed, ckpt_name );
     }
 
-  timing_evolution = CPU_TIME - timing_evolution;
+  timing_evolution  = CPU_TIME - timing_evolution - timing_check;
+  wtiming_evolution = WALL_TIME - wtiming_evolution - wtiming_check;
+
+  if ( (ckpt_every > 0) && (Nsteps % ckpt_every != 0) )
+    checkpoint_write( PP, N, Nsteps, Nsteps * dt, seed, ckpt_name );
+  checkpoint_wait();
+
+  diag_monitor( PP, N, Nsteps, Nsteps * dt );
   
   printf("Simulation finished.\n");
   printf("Total execution time: %g s (init), %g s (evolution)\n",
 	 timing_init, timing_evolution );
+  printf("Wall-clock time: %g s (init), %g s (evolution)\n", wtiming_init, wtiming_evolution );
+  if ( integrator == INTEGRATOR_KDK )
+    leapfrog_report( N );
+  if ( engine == FORCE_CELLS )
+    cells_report( N, wtiming_forces );
+
+  {
+    // the interactions are those of the all-pairs engines; the
+    // mixed-precision one works on its own float copy, of unknown traffic
+    const int    all_pairs    = ( (integrator == INTEGRATOR_EULER) &&
+				  (engine != FORCE_TREE) && (engine != FORCE_CELLS) );
+    const double interactions = ( all_pairs ? (double)N * (N-1) / 2 * (Nsteps - step0) : 0 );
+    const double updates      = (double)N * (Nsteps - step0);
+    const unsigned long long *forces_cntr = NULL;
+    const unsigned long long *update_cntr = NULL;
+   #if defined(HAVE_COUNTERS)
+    uLint papi_forces[PAPI_EVENTS_NUM];
+    for ( int e = 0; e < PAPI_EVENTS_NUM; e++ )
+      papi_forces[e] = papi_phase[0][e] + papi_phase[1][e];
+    if ( COUNTERS_OK ) {
+      forces_cntr = papi_forces;
+      update_cntr = papi_update; }
+   #endif
+
+    phase_report( (integrator == INTEGRATOR_KDK ? "Force+update phase" : "Force phase"),
+		  wtiming_forces, interactions, "interaction",
+		  FLOPS_PER_INTERACTION, (engine == FORCE_MIXED ? 0 : LAYOUT_BYTES_PER_INTERACTION),
+		  forces_cntr );
+    if ( integrator == INTEGRATOR_EULER )
+      phase_report( "Update phase", wtiming_update, updates, "particle",
+		    FLOPS_PER_UPDATE, LAYOUT_BYTES_PER_UPDATE, update_cntr );
+  }
+  if ( timing_check > 0 )
+    printf("Time spent in the force and conservation checks: %g s\n", timing_check );
+  diag_report();
+  checkpoint_report();
+
+  if ( nreorder > 0 )
+    {
+      printf("Morton reordering: %d times, %g s in total, %g s each\n",
+	     nreorder, wtiming_reorder, wtiming_reorder / nreorder );
+      for ( int s = 0; s < 2; s++ )
+	if ( nsteps_phase[s] > 0 )
+	  printf("   force phase, %s: %g s per step\n",
+		 (s ? "sorted  " : "unsorted"), wtiming_phase[s] / nsteps_phase[s] );
+     #if defined(HAVE_COUNTERS)
+      // events 2 and 3 are the L1 and L2 (or last-level) data cache misses
+      if ( COUNTERS_OK )
+	{
+	  printf("   reordering cost      : %llu L1 misses, %llu %s misses per reordering\n",
+		 papi_reorder[2] / nreorder, papi_reorder[3] / nreorder, CNTR_LL_NAME );
+	  for ( int s = 0; s < 2; s++ )
+	    if ( nsteps_phase[s] > 0 )
+	      printf("   force phase, %s: %llu L1 misses, %llu %s misses per step\n",
+		     (s ? "sorted  " : "unsorted"),
+		     papi_phase[s][2] / nsteps_phase[s], papi_phase[s][3] / nsteps_phase[s], CNTR_LL_NAME );
+	  if ( (nsteps_phase[0] > 0) && (nsteps_phase[1] > 0) )
+	    {
+	      double saved_L1 = (double)papi_phase[0][2] / nsteps_phase[0] - (double)papi_phase[1][2] / nsteps_phase[1];
+	      double saved_L2 = (double)papi_phase[0][3] / nsteps_phase[0] - (double)papi_phase[1][3] / nsteps_phase[1];
+	      printf("   saved per step       : %g L1 misses, %g %s misses -> a reordering pays off after %g steps (%s)\n",
+		     saved_L1, saved_L2, CNTR_LL_NAME,
+		     ( saved_L2 > 0 ? papi_reorder[3] / nreorder / saved_L2 : INFINITY ), CNTR_LL_NAME );
+	    }
+	}
+     #endif
+    }
 
     // Print a checksum to prevent dead code elimination and verify correctness
- #ifdef USE_SOA
-  printf("Checksum (Position of particle 0): (%f, %f, %f)\n", P.x[0], P.y[0], P.z[0]);
+    // (particle 0 is the one that was created first, wherever it is now)
+  size_t p0 = sfc_find( 0 );
+  printf("Checksum (Position of particle 0): (%f, %f, %f)\n", PX(PP,p0), PY(PP,p0), PZ(PP,p0));
+ #if defined(USE_SOA)
   free ( P.x );
+ #elif defined(USE_SPLIT)
+  free ( P.hot );
  #else
-  printf("Checksum (Position of particle 0): (%f, %f, %f)\n", P[0].x, P[0].y, P[0].z);
   free ( P );
  #endif
 
+  tree_release();
+  leapfrog_release();
+  sfc_release();
+  mixed_release();
+  checkpoint_release();
+  cells_release();
+  diag_release();
+  numa_release();
+ #if defined(HAVE_COUNTERS) && !defined(USE_PAPI)
+  perf_counters_close();
+ #endif
 
     return 0;
 }
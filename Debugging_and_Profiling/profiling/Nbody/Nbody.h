@@ -0,0 +1,348 @@
+#pragma once
+
+/**
+ * @file Nbody.h
+ * @brief Common definitions for the N-body toy simulator.
+ *
+ * The data layout is selected at compile time (-DUSE_SOA, -DUSE_AOSOA,
+ * -DUSE_SPLIT, AoS by default) as in the original single-file version; the accessor
+ * macros defined here let the kernels and the additional force engines
+ * (nbody_*.c) be written only once for all the layouts.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <time.h>
+#include <math.h>
+
+#define CPU_TIME ({struct  timespec ts; clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts ), \
+                                          (double)ts.tv_sec +           \
+                                          (double)ts.tv_nsec * 1e-9;})
+
+#define WALL_TIME ({struct  timespec ts; clock_gettime( CLOCK_MONOTONIC, &ts ), \
+                                          (double)ts.tv_sec +           \
+                                          (double)ts.tv_nsec * 1e-9;})
+
+#define NP_dflt 2048
+#define NSTEPS_dflt 100
+#define G 6.67430e-11 // Gravitational constant
+#define DT 0.01       // Time step
+
+// Epsilon to avoid division by zero when bodies are at the same position.
+extern const double epsilon_sq;
+
+// ─────────────────────────────────────────────────────────────────
+// the layouts
+//
+// all the types are always defined, so that the layouts can be compared
+// in the same run (see nbody_layouts.c); particle_t is the one selected at
+// compile time
+//
+
+// --- Array of Structs (AoS) Layout ---
+// Cache-unfriendly for this problem
+typedef struct {
+    double x, y, z;
+    double vx, vy, vz;
+    double mass;
+    double fx, fy, fz; // Forces
+} particle_aos_t;
+
+// --- Struct of Arrays (SoA) Layout ---
+// Cache-friendly for this problem
+typedef struct {
+    double* x, * y, * z;
+    double* vx, * vy, * vz;
+    double* mass;
+    double* fx, * fy, * fz; // Forces
+} particle_soa_t;
+
+// --- Array of Structs of Arrays (AoSoA) Layout ---
+// a block of AOSOA_W particles per element: each field is a short
+// vector, and all the fields of a particle are in the same block
+#ifndef AOSOA_W
+#define AOSOA_W 8           // 8 doubles = one cache line, one AVX-512 register
+#endif
+typedef struct {
+    double x[AOSOA_W], y[AOSOA_W], z[AOSOA_W];
+    double vx[AOSOA_W], vy[AOSOA_W], vz[AOSOA_W];
+    double mass[AOSOA_W];
+    double fx[AOSOA_W], fy[AOSOA_W], fz[AOSOA_W];
+} particle_aosoa_t;
+
+#define AOSOA_NBLOCKS(N) ( ((N) + AOSOA_W - 1) / AOSOA_W )
+
+// --- Hot/cold split Layout ---
+// what the pair loop reads (position and mass) is packed in a 32-bytes
+// record, two per cache line; velocities and forces are kept elsewhere
+typedef struct {
+    double x, y, z;
+    double mass;
+} particle_hot_t;
+
+typedef struct {
+    double vx, vy, vz;
+} particle_vel_t;
+
+typedef struct {
+    double fx, fy, fz;
+} particle_force_t;
+
+typedef struct {
+    particle_hot_t   *hot;
+    particle_vel_t   *vel;
+    particle_force_t *force;
+} particle_split_t;
+
+// field f of particle i, P being a pointer to the particles for AoS and
+// AoSoA and a pointer to the struct of arrays for SoA and the split layout
+#define AOS_FIELD(P,i,f)    ((P)[i].f)
+#define SOA_FIELD(P,i,f)    ((P)->f[i])
+#define AOSOA_FIELD(P,i,f)  ((P)[(i)/AOSOA_W].f[(i)%AOSOA_W])
+#define SPLIT_FIELD(P,i,f)  SPLIT_ ## f(P,i)
+
+#define SPLIT_x(P,i)        ((P)->hot[i].x)
+#define SPLIT_y(P,i)        ((P)->hot[i].y)
+#define SPLIT_z(P,i)        ((P)->hot[i].z)
+#define SPLIT_mass(P,i)     ((P)->hot[i].mass)
+#define SPLIT_vx(P,i)       ((P)->vel[i].vx)
+#define SPLIT_vy(P,i)       ((P)->vel[i].vy)
+#define SPLIT_vz(P,i)       ((P)->vel[i].vz)
+#define SPLIT_fx(P,i)       ((P)->force[i].fx)
+#define SPLIT_fy(P,i)       ((P)->force[i].fy)
+#define SPLIT_fz(P,i)       ((P)->force[i].fz)
+
+// bytes of the cache lines moved by the pair loop for every interaction:
+// the j-particle is read for x, y, z, mass, fx, fy, fz and written for
+// fx, fy, fz. AoS brings in and writes back whole particles, velocities
+// included; the other layouts move only the fields that are used
+#define AOS_BYTES_PER_INTERACTION    ( 2 * 10 * sizeof(double) )
+#define SOA_BYTES_PER_INTERACTION    ( (7 + 3) * sizeof(double) )
+#define AOSOA_BYTES_PER_INTERACTION  SOA_BYTES_PER_INTERACTION
+#define SPLIT_BYTES_PER_INTERACTION  ( sizeof(particle_hot_t) + 2 * sizeof(particle_force_t) )
+
+// bytes moved by update_particles() for every particle: all the fields are
+// read, positions and velocities written; AoS writes back whole particles,
+// the split layout whole hot records
+#define AOS_BYTES_PER_UPDATE    ( 2 * 10 * sizeof(double) )
+#define SOA_BYTES_PER_UPDATE    ( (10 + 6) * sizeof(double) )
+#define AOSOA_BYTES_PER_UPDATE  SOA_BYTES_PER_UPDATE
+#define SPLIT_BYTES_PER_UPDATE  ( 2 * sizeof(particle_hot_t) + 2 * sizeof(particle_vel_t) + \
+				  sizeof(particle_force_t) )
+
+// the customary flop counts: ~20 per interaction (the square root and the
+// division counted as one each), 16 per particle update
+#define FLOPS_PER_INTERACTION   20
+#define FLOPS_PER_UPDATE        16
+
+// the bytes of a particle, whatever the layout
+#define PARTICLE_BYTES      ( 10 * sizeof(double) )
+
+#if defined(USE_SOA)
+typedef particle_soa_t   particle_t;
+#define PFIELD        SOA_FIELD
+#define LAYOUT_NAME   "Structures of Arrays"
+#define LAYOUT_ID     1
+#define LAYOUT_BYTES_PER_INTERACTION  SOA_BYTES_PER_INTERACTION
+#define LAYOUT_BYTES_PER_UPDATE       SOA_BYTES_PER_UPDATE
+#define LAYOUT_ARRAYS       // particle_t describes arrays, and is passed as &P
+#elif defined(USE_AOSOA)
+typedef particle_aosoa_t particle_t;
+#define PFIELD        AOSOA_FIELD
+#define LAYOUT_NAME   "Arrays of Structures of Arrays"
+#define LAYOUT_ID     2
+#define LAYOUT_BYTES_PER_INTERACTION  AOSOA_BYTES_PER_INTERACTION
+#define LAYOUT_BYTES_PER_UPDATE       AOSOA_BYTES_PER_UPDATE
+#elif defined(USE_SPLIT)
+typedef particle_split_t particle_t;
+#define PFIELD        SPLIT_FIELD
+#define LAYOUT_NAME   "hot/cold split records"
+#define LAYOUT_ID     3
+#define LAYOUT_BYTES_PER_INTERACTION  SPLIT_BYTES_PER_INTERACTION
+#define LAYOUT_BYTES_PER_UPDATE       SPLIT_BYTES_PER_UPDATE
+#define LAYOUT_ARRAYS
+#else
+typedef particle_aos_t   particle_t;
+#define PFIELD        AOS_FIELD
+#define LAYOUT_NAME   "Arrays of structures"
+#define LAYOUT_ID     0
+#define LAYOUT_BYTES_PER_INTERACTION  AOS_BYTES_PER_INTERACTION
+#define LAYOUT_BYTES_PER_UPDATE       AOS_BYTES_PER_UPDATE
+#endif
+
+
+// ─────────────────────────────────────────────────────────────────
+// layout-independent accessors
+// P is always a particle_t*, i.e. &P for SoA and split, P for AoS and AoSoA
+//
+#define PX(P,i)   PFIELD(P,i,x)
+#define PY(P,i)   PFIELD(P,i,y)
+#define PZ(P,i)   PFIELD(P,i,z)
+#define PVX(P,i)  PFIELD(P,i,vx)
+#define PVY(P,i)  PFIELD(P,i,vy)
+#define PVZ(P,i)  PFIELD(P,i,vz)
+#define PM(P,i)   PFIELD(P,i,mass)
+#define PFX(P,i)  PFIELD(P,i,fx)
+#define PFY(P,i)  PFIELD(P,i,fy)
+#define PFZ(P,i)  PFIELD(P,i,fz)
+
+//
+// ------------------------------------------------------------------
+
+
+// ─────────────────────────────────────────────────────────────────
+// counter-based random numbers
+// the k-th number of the stream "seed" is a pure function of (seed, k):
+// the SplitMix64 generator, whose state after k steps is simply
+// seed + k * RNG_GAMMA. No state is shared, so the numbers can be drawn
+// in any order, by any number of threads, with identical results.
+//
+#define RNG_GAMMA   0x9e3779b97f4a7c15ULL
+
+static inline unsigned long long rng_mix ( unsigned long long z )
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// uniform in [0,1), with 53 random bits
+static inline double rng_uniform ( const unsigned long long seed, const unsigned long long k )
+{
+  // the seed is mixed first, so that close seeds give unrelated streams
+  return (double)( rng_mix( rng_mix( seed ) + (k + 1) * RNG_GAMMA ) >> 11 ) * 0x1.0p-53;
+}
+
+//
+// ------------------------------------------------------------------
+
+
+// ─────────────────────────────────────────────────────────────────
+// force engines, selectable at run-time
+//
+#define FORCE_DIRECT 0      // O(N^2) direct summation, the reference
+#define FORCE_TREE   1      // Barnes-Hut octree, O(N log N)
+#define FORCE_OMP    2      // multi-threaded direct summation
+#define FORCE_SIMD   3      // hand-vectorized direct summation (SoA only)
+#define FORCE_MIXED  4      // direct summation, float pairs and double sums
+#define FORCE_CELLS  5      // short-range forces with a cutoff, on a cell list
+
+#define SIMD_NONE    0      // instruction sets for the SIMD engine,
+#define SIMD_AVX2    1      // in increasing order
+#define SIMD_AVX512  2
+
+#define THETA_dflt   0.5    // default opening angle for the tree
+#define RCUT_dflt    0.1    // default cutoff radius for the cell list
+#define RON_FRACTION 0.8    // the cutoff switch starts at 0.8 rc
+
+// the switch that brings the force to zero between RON_FRACTION rc and rc
+// (see nbody_cells.c), from the squared distance and cutoff radius
+static inline double cutoff_switch ( const double r2, const double rc2 )
+{
+  const double ron2 = RON_FRACTION * RON_FRACTION * rc2;
+  if ( r2 >= rc2 )
+    return 0;
+  if ( r2 <= ron2 )
+    return 1;
+  const double s = (rc2 - r2) / (rc2 - ron2);
+  return s * s * (3 - 2*s);
+}
+
+// ─────────────────────────────────────────────────────────────────
+// integrators
+//
+#define INTEGRATOR_EULER 0  // single global timestep, Euler
+#define INTEGRATOR_KDK   1  // leapfrog, hierarchical individual timesteps
+
+#define ETA_dflt     0.02   // accuracy parameter for the individual timesteps
+
+
+#ifdef LAYOUT_ARRAYS
+void initialize_particles ( particle_t *, const size_t N, const long seed );
+#else
+void initialize_particles ( particle_t **, const size_t N, const long seed );
+#endif
+void compute_forces       ( particle_t * restrict, const size_t );
+double compute_forces_potential ( particle_t * restrict, const size_t );
+void update_particles     ( particle_t *, size_t, double );
+double force_error        ( particle_t * restrict, const size_t, const size_t, const double, double * );
+
+// nbody_omp.c
+void   compute_forces_omp  ( particle_t * restrict, const size_t );
+double compute_forces_omp_potential ( particle_t * restrict, const size_t );
+
+// nbody_simd.c
+int         simd_select         ( const char * );
+const char *simd_name           ( int );
+void        compute_forces_simd ( particle_t * restrict, const size_t );
+
+// nbody_tree.c
+void   compute_forces_tree ( particle_t * restrict, const size_t, const double );
+void   compute_forces_tree_active ( particle_t * restrict, const size_t, const double,
+				    const size_t * restrict, const size_t );
+void   tree_release        ( void );
+
+// nbody_leapfrog.c
+void   leapfrog_step       ( particle_t * restrict, const size_t, const double,
+			     const double, const int, const double, const double );
+void   leapfrog_report     ( const size_t );
+void   leapfrog_permute    ( const size_t * restrict, const size_t );
+void   leapfrog_release    ( void );
+
+// nbody_mixed.c
+void   compute_forces_mixed ( particle_t * restrict, const size_t, const int );
+void   mixed_release        ( void );
+
+// nbody_numa.c
+int    numa_setup          ( const int );
+int    numa_nodes          ( void );
+int    numa_my_node        ( void );
+int    numa_is_leader      ( void );
+void   numa_report         ( void );
+void   numa_release        ( void );
+
+// nbody_cells.c
+void   compute_forces_cells ( particle_t * restrict, const size_t, const double );
+void   compute_forces_cells_active ( particle_t * restrict, const size_t, const double,
+				     const size_t * restrict, const size_t );
+void   cells_invalidate     ( void );
+void   cells_report         ( const size_t, const double );
+void   cells_release        ( void );
+
+// nbody_diag.c
+void   diag_monitor        ( particle_t * restrict, const size_t, const int, const double );
+void   diag_monitor_potential ( particle_t * restrict, const size_t, const int, const double,
+				const double );
+int    diag_open           ( const char *, const size_t );
+void   diag_report         ( void );
+void   diag_release        ( void );
+
+// nbody_io.c
+int    checkpoint_write    ( particle_t * restrict, const size_t, const long, const double,
+			     const long, const char * );
+int    checkpoint_wait     ( void );
+int    checkpoint_info     ( const char *, size_t *, long *, double *, long * );
+int    checkpoint_read     ( const char *, particle_t * restrict, const size_t );
+void   checkpoint_report   ( void );
+void   checkpoint_release  ( void );
+
+// nbody_perf.c, used through mypapi.h when PAPI is not there
+#define PERF_EVENTS_NUM 4
+int    perf_counters_open  ( void );
+int    perf_counters_ok    ( void );
+void   perf_counters_start ( void );
+void   perf_counters_stop  ( unsigned long long [PERF_EVENTS_NUM] );
+void   perf_counters_close ( void );
+
+// nbody_layouts.c
+void   layout_benchmark    ( particle_t * restrict, const size_t, const int );
+
+// nbody_sort.c
+const size_t *sfc_reorder  ( particle_t * restrict, const size_t );
+size_t        sfc_find     ( const size_t );
+const size_t *sfc_ids      ( void );
+void          sfc_release  ( void );
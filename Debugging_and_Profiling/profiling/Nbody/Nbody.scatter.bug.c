@@ -12,10 +12,10 @@
  * --- How to Compile & Run ---
  *
  * For the slow, cache-unfriendly version (AoS):
- * gcc -g -O3 -o nbody_aos nbody_simulation.c -lm
+ * gcc -g -O3 -o nbody_scatter_aos Nbody.scatter.bug.c index_set.c -lm
  *
  * For the fast, cache-friendly version (SoA):
- * gcc -g -O3 -DUSE_SOA -o nbody_soa nbody_simulation.c -lm
+ * gcc -g -O3 -DUSE_SOA -o nbody_scatter_soa Nbody.scatter.bug.c index_set.c -lm
  *
  * The -g flag includes debug symbols for profiling.
  * The -O3 flag is important to enable vectorization and other optimizations,
@@ -33,6 +33,8 @@
 #include <time.h>
 #include <math.h>
 
+#include "index_set.h"
+
 #define CPU_TIME ({struct  timespec ts; clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts ), \
                                           (double)ts.tv_sec +           \
                                           (double)ts.tv_nsec * 1e-9;})
@@ -72,7 +74,7 @@ void initialize_particles ( particle_t *, const size_t N );
 #else
 void initialize_particles ( particle_t **, const size_t N );
 #endif
-void compute_forces       ( particle_t * restrict, const size_t, const size_t * restrict, const size_t );
+void compute_forces       ( particle_t * restrict, const size_t, const size_t * restrict, const size_t, arena_t * );
 void update_particles     ( particle_t *, double, const size_t * restrict, const size_t );
 
 
@@ -147,34 +149,10 @@ void initialize_particles ( particle_t ** _P, const size_t N )
  */
 
 
-int insert ( size_t idx, size_t *list, size_t n )
-{
-  size_t j = 0;
-  while ( (j < n) && (idx >= list[j]) )
-    j++;
-  if ( idx == list[j] )
-    return 0;
-
-  size_t k = n-1;
-  for ( size_t k = n; k>j; k-- )
-    list[k] = list[k-1];
-  list[j] = idx;
-
-  return 1;
-}
-
-
-int unique ( size_t idx, size_t *list, size_t n )
-{
-  size_t j = 0;
-  while ( (j < n) && (idx != list[j]) )
-    j++;
-  return ( j == n );
-}
-
-
+// the number of targets of every active particle is 1 + N/100 + [0, N/20)
+#define MAX_TARGETS( N ) ( 1 + (N)/100 + (N)/20 )
 
-void compute_forces ( particle_t * restrict P, const size_t N, const size_t * restrict active_indexes, const size_t Nactive )
+void compute_forces ( particle_t * restrict P, const size_t N, const size_t * restrict active_indexes, const size_t Nactive, arena_t *A )
 {
 
   
@@ -188,6 +166,16 @@ void compute_forces ( particle_t * restrict P, const size_t N, const size_t * re
     P[i].fx = P[i].fy = P[i].fz = 0.0; }
  #endif
 
+  // gather buffers, reused by all the active particles
+  //
+  size_t  maxtargets = MAX_TARGETS( N );
+  double *tx  = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *ty  = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *tz  = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *tm  = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *tfx = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *tfy = (double*)arena_alloc( A, maxtargets * sizeof(double) );
+  double *tfz = (double*)arena_alloc( A, maxtargets * sizeof(double) );
   
   for ( size_t k = 0; k < Nactive; k++ )
     {
@@ -210,46 +198,41 @@ void compute_forces ( particle_t * restrict P, const size_t N, const size_t * re
       double fz = 0;
 
 
-      // generate the list of target particles
-      size_t Ntargets = 1+(N/100) + lrand48() % (N/20);
-      size_t *target_indexes = (size_t*)malloc( Ntargets * sizeof(size_t) );
-      
-      for ( size_t i = 0; i < Ntargets; i++ )
-	{
-	  int done = 0;
-	  while (!done)
-	    {
-	      size_t idx = lrand48() % N;
-	      // generate list of sorted unique particles
-	      //done = insert( idx, active_indexes, i );
-	      // just check that the id are unique
-	      done = unique( idx, target_indexes, i );
-	    }
-	}      
-      
-      for (size_t t = 0; t < Ntargets; t++)
+      // generate the sorted list of unique target particles;
+      // its space is given back to the arena at the end of the iteration
+      size_t  mark     = arena_mark( A );
+      size_t  Ntargets = 1+(N/100) + ( N >= 20 ? lrand48() % (N/20) : 0 );
+      size_t *target_indexes = sample_sorted_indexes( A, Ntargets, N );
+
+      // gather: the indexes are sorted, so the memory is walked forward
+      for ( size_t t = 0; t < Ntargets; t++ )
 	{
 	  size_t idx = target_indexes[t];
-	  
 	 #ifdef USE_SOA
-	  double dx = P->x[idx] - x;
-	  double dy = P->y[idx] - y;
-	  double dz = P->z[idx] - z;
+	  tx[t] = P->x[idx];
+	  ty[t] = P->y[idx];
+	  tz[t] = P->z[idx];
+	  tm[t] = P->mass[idx];
 	 #else
-	  double dx = P[idx].x - x;
-	  double dy = P[idx].y - y;
-	  double dz = P[idx].z - z;
+	  tx[t] = P[idx].x;
+	  ty[t] = P[idx].y;
+	  tz[t] = P[idx].z;
+	  tm[t] = P[idx].mass;
 	 #endif
+	}
+
+      // compute on contiguous data
+      for (size_t t = 0; t < Ntargets; t++)
+	{
+	  double dx = tx[t] - x;
+	  double dy = ty[t] - y;
+	  double dz = tz[t] - z;
 	  
 	  double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
 	  double inv_dist = 1.0 / sqrt(dist_sq);
 	  double inv_dist_cubed = inv_dist * inv_dist * inv_dist;
 
-	 #ifdef USE_SOA
-	  double force_mag = mG * P->mass[idx] * inv_dist_cubed;
-	 #else
-	  double force_mag = mG * P[idx].mass * inv_dist_cubed;
-	 #endif
+	  double force_mag = mG * tm[t] * inv_dist_cubed;
 	  
 	  double _fx = force_mag * dx;
 	  double _fy = force_mag * dy;
@@ -258,17 +241,38 @@ void compute_forces ( particle_t * restrict P, const size_t N, const size_t * re
 	  fx += _fx;
 	  fy += _fy;
 	  fz += _fz;
-	  
+
+	  tfx[t] = _fx;
+	  tfy[t] = _fy;
+	  tfz[t] = _fz;
+	}
+
+      // scatter, again walking the memory forward
+      for ( size_t t = 0; t < Ntargets; t++ )
+	{
+	  size_t idx = target_indexes[t];
 	 #ifdef USE_SOA
-	  P->fx[idx] -= _fx;
-	  P->fy[idx] -= _fy;
-	  P->fz[idx] -= _fz;
+	  P->fx[idx] -= tfx[t];
+	  P->fy[idx] -= tfy[t];
+	  P->fz[idx] -= tfz[t];
 	 #else
-	  P[idx].fx -= _fx;
-	  P[idx].fy -= _fy;
-	  P[idx].fz -= _fz;
+	  P[idx].fx -= tfx[t];
+	  P[idx].fy -= tfy[t];
+	  P[idx].fz -= tfz[t];
 	 #endif
 	}
+
+     #ifdef USE_SOA
+      P->fx[i] += fx;
+      P->fy[i] += fy;
+      P->fz[i] += fz;
+     #else
+      P[i].fx += fx;
+      P[i].fy += fy;
+      P[i].fz += fz;
+     #endif
+
+      arena_release( A, mark );
     }
 }
   
@@ -329,7 +333,7 @@ int main ( int argc, char **argv )
   if ( seed == 0 )
     seed = time(NULL);
 
-  srand ( seed );
+  srand48 ( seed );     // lrand48() is what picks the active and target particles
   
   printf ( " »»» N-Body toy simulator\n"
 	   " using %s\n"
@@ -357,37 +361,34 @@ int main ( int argc, char **argv )
   printf("Starting simulation for %llu bodies over %lu timesteps...\n",
 	 (unsigned long long)N, Nsteps );
 
+  // the arena holds, at most, the active list (and its sorting buffer),
+  // one target list (and its sorting buffer) and the 7 gather buffers
+  arena_t arena;
+  size_t  arena_size = ( 2 * (1 + N/10 + N/10) * sizeof(size_t) +
+			 2 * MAX_TARGETS( N ) * sizeof(size_t) +
+			 7 * MAX_TARGETS( N ) * sizeof(double) + 16 * 64 );
+  if ( arena_init( &arena, arena_size, N ) ) {
+    printf("unable to allocate the index arena\n");
+    return 1; }
+
   double timing_evolution = CPU_TIME;
   
   for (int step = 0; step < Nsteps; step++ )
     {
 
-      size_t Nactive = 1+(N/10) + lrand48()%(N/10);
-      // generate the list of active particles
-      size_t *active_indexes = (size_t*)malloc( Nactive * sizeof(size_t) );
-      
-      for ( size_t i = 0; i < Nactive; i++ )
-	{
-	  int done = 0;
-	  while (!done)
-	    {
-	      size_t idx = lrand48() % N;
-	      // generate list of sorted unique particles
-	      //done = insert( idx, active_indexes, i );
-	      // just check that the id are unique
-	      done = unique( idx, active_indexes, i );
-	    }
-	}
+      arena_reset( &arena );
+
+      // generate the sorted list of active particles
+      size_t Nactive = 1+(N/10) + ( N >= 10 ? lrand48()%(N/10) : 0 );
+      size_t *active_indexes = sample_sorted_indexes( &arena, Nactive, N );
       
      #ifdef USE_SOA
-      compute_forces( &P, N, active_indexes, Nactive );
+      compute_forces( &P, N, active_indexes, Nactive, &arena );
       update_particles( &P, dt, active_indexes, Nactive  );
      #else
-      compute_forces( P, N, active_indexes, Nactive  );
+      compute_forces( P, N, active_indexes, Nactive, &arena  );
       update_particles( P, dt, active_indexes, Nactive  );
      #endif
-
-      free ( active_indexes );
     }
 
   timing_evolution = CPU_TIME - timing_evolution;
@@ -405,6 +406,8 @@ int main ( int argc, char **argv )
   free ( P );
  #endif
 
+  arena_free( &arena );
+
 
     return 0;
 }
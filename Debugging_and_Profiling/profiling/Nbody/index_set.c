@@ -0,0 +1,138 @@
+/**
+ * @file index_set.c
+ * @brief Arena and sorted unique index sampling, see index_set.h
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "index_set.h"
+
+#define ARENA_ALIGN 64      // every list starts on a cache line
+#define RADIX_BITS  11
+#define RADIX       (1 << RADIX_BITS)
+
+
+/**
+ * @brief Prepares an arena of size bytes, for indexes in [0, n).
+ * @return 0 on success
+ */
+int arena_init ( arena_t *A, size_t size, size_t n )
+{
+  A->size  = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  A->used  = 0;
+  A->base  = (char*)aligned_alloc( ARENA_ALIGN, A->size );
+  A->nseen = n;
+  A->seen  = (uint64_t*)calloc( (n + 63) / 64, sizeof(uint64_t) );
+
+  if ( (A->base == NULL) || (A->seen == NULL) )
+    {
+      arena_free( A );
+      return 1;
+    }
+  return 0;
+}
+
+
+void arena_free ( arena_t *A )
+{
+  free ( A->base );
+  free ( A->seen );
+  A->base = NULL;
+  A->seen = NULL;
+  A->size = A->used = A->nseen = 0;
+}
+
+
+void *arena_alloc ( arena_t *A, size_t bytes )
+{
+  size_t need = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+  if ( A->used + need > A->size )
+    {
+      fprintf( stderr, "arena exhausted: %zu bytes requested, %zu available\n",
+	       need, A->size - A->used );
+      exit( 1 );
+    }
+
+  void *ptr = A->base + A->used;
+  A->used += need;
+  return ptr;
+}
+
+
+/**
+ * @brief LSD radix sort of k indexes in [0, n), from in to out.
+ * Only the digits needed to represent n-1 are processed; if the number of
+ * passes is odd the result is copied back, so that it ends up in out.
+ */
+void radix_sort_indexes ( size_t * restrict in, size_t * restrict out, size_t k, size_t n )
+{
+  int bits = 1;
+  while ( (bits < 64) && ((size_t)1 << bits) < n )
+    bits++;
+
+  size_t count[RADIX];
+  size_t *src = in;
+  size_t *dst = out;
+
+  for ( int shift = 0; shift < bits; shift += RADIX_BITS )
+    {
+      memset( count, 0, sizeof(count) );
+      for ( size_t i = 0; i < k; i++ )
+	count[(src[i] >> shift) & (RADIX-1)]++;
+
+      size_t sum = 0;
+      for ( int d = 0; d < RADIX; d++ ) {
+	size_t c = count[d];
+	count[d] = sum;
+	sum += c; }
+
+      for ( size_t i = 0; i < k; i++ )
+	dst[count[(src[i] >> shift) & (RADIX-1)]++] = src[i];
+
+      size_t *t = src; src = dst; dst = t;
+    }
+
+  if ( src != out )
+    memcpy( out, src, k * sizeof(size_t) );
+}
+
+
+/**
+ * @brief k unique indexes in [0, n), sorted, allocated in the arena.
+ * Floyd's algorithm: for j = n-k .. n-1 draw t in [0, j]; take t if it is
+ * new, j otherwise (j cannot have been taken before). The membership map is
+ * cleaned up by walking the k selected indexes, so the cost is O(k) and not
+ * O(n).
+ */
+size_t *sample_sorted_indexes ( arena_t *A, size_t k, size_t n )
+{
+  if ( k > n )
+    k = n;
+
+  size_t *list = (size_t*)arena_alloc( A, k * sizeof(size_t) );
+  size_t  mark = arena_mark( A );
+  size_t *tmp  = (size_t*)arena_alloc( A, k * sizeof(size_t) );
+
+  size_t c = 0;
+  for ( size_t j = n - k; j < n; j++ )
+    {
+      size_t t = (size_t)lrand48() % (j + 1);
+      if ( A->seen[t / 64] & ((uint64_t)1 << (t % 64)) )
+	t = j;
+      A->seen[t / 64] |= ((uint64_t)1 << (t % 64));
+      tmp[c++] = t;
+    }
+
+  for ( size_t i = 0; i < k; i++ )
+    A->seen[tmp[i] / 64] = 0;
+
+  radix_sort_indexes( tmp, list, k, n );
+
+  arena_release( A, mark );
+  return list;
+}
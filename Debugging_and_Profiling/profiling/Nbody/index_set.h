@@ -0,0 +1,41 @@
+#pragma once
+
+/**
+ * @file index_set.h
+ * @brief Per-step index lists: a bump arena and sorted unique sampling.
+ *
+ * The lists of active and target particles change at every step. Instead
+ * of a malloc (and a forgotten free) for each of them, they are carved out
+ * of an arena that is reset at the beginning of every step; a mark/release
+ * pair allows to recycle the space of short-lived lists inside the step.
+ *
+ * Unique indexes are drawn with Floyd's algorithm, which needs exactly k
+ * random numbers for k indexes out of n (no rejection loop), and are then
+ * sorted with an LSD radix sort, so that the particles are visited in
+ * increasing memory order. Both steps are O(k).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  char     *base;
+  size_t    size;
+  size_t    used;
+  uint64_t *seen;           // n-bit membership map used by the sampling
+  size_t    nseen;          // number of bits in seen
+} arena_t;
+
+
+int     arena_init    ( arena_t *, size_t size, size_t n );
+void    arena_free    ( arena_t * );
+void   *arena_alloc   ( arena_t *, size_t bytes );
+
+// the whole arena is recycled at every step
+static inline void   arena_reset   ( arena_t *A )              { A->used = 0; }
+// lists allocated after a mark are released all at once
+static inline size_t arena_mark    ( arena_t *A )              { return A->used; }
+static inline void   arena_release ( arena_t *A, size_t mark ) { A->used = mark; }
+
+size_t *sample_sorted_indexes ( arena_t *, size_t k, size_t n );
+void    radix_sort_indexes    ( size_t * restrict, size_t * restrict, size_t k, size_t n );
@@ -0,0 +1,487 @@
+/**
+ * @file nbody_cells.c
+ * @brief Short-range forces with a cutoff radius, on a cell list.
+ *
+ * When only the interactions closer than a cutoff radius rc matter, the
+ * particles are binned in cells of side rc: the partners of a particle are
+ * then all in its own cell and in the 26 neighbouring ones. Every pair of
+ * cells is visited once (the cell itself plus the 13 neighbours of a "half
+ * shell"), with the Newton's third law.
+ *
+ * The cells are not those of a grid around the particles: the system
+ * spreads over thousands of rc in a few steps, and a grid with a bounded
+ * number of cells would then have cells much wider than rc, with most of
+ * the particles in a few of them. The cells are instead identified by
+ * their three integer coordinates, packed in a key, and hashed in a table
+ * of BUCKETS_PER_PARTICLE buckets per particle: the cells stay rc wide
+ * whatever the extent of the system, and only the occupied ones cost
+ * memory. Two cells may share a bucket, so the candidate partners found in
+ * a bucket are first checked for their key.
+ *
+ * The force is the usual softened one, times a switching function that
+ * brings it smoothly to zero between r_on = RON_FRACTION * rc and rc:
+ *
+ *      S = 1                       r < r_on
+ *      S = s^2 (3 - 2 s)           r_on <= r < rc,  s = (rc^2 - r^2) / (rc^2 - r_on^2)
+ *
+ * so that no particle feels a jump in the force when it crosses rc.
+ *
+ * The positions and the masses are copied into arrays sorted by bucket, so
+ * that the particles of a cell are contiguous and the inner loop streams
+ * through them; the order is kept from step to step together with the key
+ * of every particle. Since the particles move by a small fraction of a cell
+ * in a step, the table is updated incrementally:
+ *  - the keys are recomputed, and if no particle has changed bucket the
+ *    order is still valid and the sort is skipped;
+ *  - otherwise a stable counting sort is done starting from the previous
+ *    order, which is almost sorted and cheap to traverse.
+ */
+
+#include <stdint.h>
+
+#include "Nbody.h"
+
+#define BUCKETS_PER_PARTICLE 2
+#define KEY_BITS      21                // bits per cell coordinate in a key
+#define KEY_MASK      (((uint64_t)1 << KEY_BITS) - 1)
+
+
+typedef struct {
+  size_t    N;
+  double   *x, *y, *z, *m;      // sorted by bucket
+  double   *fx, *fy, *fz;
+  size_t   *idx, *idx2;         // idx[k]: the particle in sorted position k
+  size_t   *imem;               // idx and idx2 are swapped, this is the allocation
+  uint64_t *key, *key2;         // key of the cell of sorted position k
+  uint64_t *kmem;               // the same for key and key2
+  size_t   *start;              // start[b] .. start[b+1]: the particles of bucket b
+  size_t    nbuckets;           // a power of 2
+  int       shift;              // 64 - log2(nbuckets)
+  double    rc, inv_side;
+  int       valid;
+} cells_t;
+
+static cells_t grid = { 0 };
+
+static unsigned long long ncalls      = 0;
+static unsigned long long nrebuilds   = 0;  // new table, from scratch
+static unsigned long long nsorts      = 0;  // new order, same table
+static unsigned long long npairs      = 0;  // candidate pairs examined
+static unsigned long long ninteract   = 0;  // pairs within the cutoff
+static unsigned long long nactive_calls = 0; // on the active particles only
+static unsigned long long nactive     = 0;  // active particles updated
+static unsigned long long apairs      = 0;  // candidate partners examined by them
+static unsigned long long ainteract   = 0;  // partners within the cutoff
+static double             wtime_grid  = 0;
+
+
+static void allocate ( const size_t N )
+{
+  if ( grid.N == N )
+    return;
+
+  cells_release();
+  grid.nbuckets = 2;
+  grid.shift    = 63;
+  while ( grid.nbuckets < BUCKETS_PER_PARTICLE * N ) {
+    grid.nbuckets *= 2;
+    grid.shift--; }
+
+  grid.x     = (double*)malloc( 7 * N * sizeof(double) );
+  grid.imem  = (size_t*)malloc( 2 * N * sizeof(size_t) );
+  grid.kmem  = (uint64_t*)malloc( 2 * N * sizeof(uint64_t) );
+  grid.start = (size_t*)malloc( (grid.nbuckets + 1) * sizeof(size_t) );
+  if ( (grid.x == NULL) || (grid.imem == NULL) || (grid.kmem == NULL) || (grid.start == NULL) ) {
+    fprintf( stderr, "unable to allocate the cell list\n" );
+    exit( 1 ); }
+  grid.y     = grid.x + N;
+  grid.z     = grid.x + 2*N;
+  grid.m     = grid.x + 3*N;
+  grid.fx    = grid.x + 4*N;
+  grid.fy    = grid.x + 5*N;
+  grid.fz    = grid.x + 6*N;
+  grid.idx   = grid.imem;
+  grid.idx2  = grid.imem + N;
+  grid.key   = grid.kmem;
+  grid.key2  = grid.kmem + N;
+
+  for ( size_t k = 0; k < N; k++ )
+    grid.idx[k] = k;
+  grid.N     = N;
+  grid.valid = 0;
+}
+
+
+/**
+ * @brief The cell coordinate of x, modulo 2^KEY_BITS: the cells that far
+ * apart share a key, as two cells share a bucket, and the distance check
+ * tells their particles apart.
+ */
+static inline uint64_t cell_coord ( const double x )
+{
+  double c = fmin( fmax( floor( x * grid.inv_side ), -0x1p62 ), 0x1p62 );
+  return (uint64_t)(int64_t)c & KEY_MASK;
+}
+
+
+/**
+ * @brief The key of the cell of the particle i.
+ */
+static inline uint64_t key_of ( particle_t * restrict P, const size_t i )
+{
+  return cell_coord( PX(P,i) ) | ( cell_coord( PY(P,i) ) << KEY_BITS ) |
+    ( cell_coord( PZ(P,i) ) << (2 * KEY_BITS) );
+}
+
+
+/**
+ * @brief The key of the cell at (dx,dy,dz) cells from the one of key.
+ */
+static inline uint64_t neighbour_key ( const uint64_t key, const int dx, const int dy, const int dz )
+{
+  return ( (key + dx) & KEY_MASK ) | ( ((key >> KEY_BITS) + dy) & KEY_MASK ) << KEY_BITS |
+    ( ((key >> (2 * KEY_BITS)) + dz) & KEY_MASK ) << (2 * KEY_BITS);
+}
+
+
+/**
+ * @brief The bucket of a key (Fibonacci hashing: the top bits of the key
+ * times 2^64 / golden ratio).
+ */
+static inline size_t bucket_of ( const uint64_t key )
+{
+  return (size_t)( (key * 0x9E3779B97F4A7C15ull) >> grid.shift );
+}
+
+
+/**
+ * @brief Brings the cell list up to date with the positions in P.
+ */
+static void update_grid ( particle_t * restrict P, const size_t N, const double rc )
+{
+  int    rebuild = !grid.valid || (rc != grid.rc);
+  size_t moved   = 0;
+
+  if ( rebuild )
+    {
+      grid.rc       = rc;
+      grid.inv_side = 1.0 / rc;
+      moved         = N;
+    }
+  for ( size_t k = 0; k < N; k++ )
+    {
+      grid.key2[k] = key_of( P, grid.idx[k] );
+      if ( !rebuild )
+	moved += ( bucket_of( grid.key2[k] ) != bucket_of( grid.key[k] ) );
+    }
+
+  if ( moved > 0 )
+    {
+      // stable counting sort of the sorted positions by their new bucket
+      size_t *start = grid.start;
+      memset( start, 0, (grid.nbuckets + 1) * sizeof(size_t) );
+      for ( size_t k = 0; k < N; k++ )
+	start[bucket_of( grid.key2[k] ) + 1]++;
+      for ( size_t b = 0; b < grid.nbuckets; b++ )
+	start[b+1] += start[b];
+      for ( size_t k = 0; k < N; k++ )
+	{
+	  size_t pos = start[bucket_of( grid.key2[k] )]++;
+	  grid.idx2[pos] = grid.idx[k];
+	  grid.key[pos]  = grid.key2[k];
+	}
+      // start[b] is now the end of bucket b
+      memmove( start + 1, start, grid.nbuckets * sizeof(size_t) );
+      start[0] = 0;
+
+      size_t *t = grid.idx; grid.idx = grid.idx2; grid.idx2 = t;
+      if ( rebuild )
+	nrebuilds++;
+      else
+	nsorts++;
+    }
+  else
+    {
+      // same buckets, but a particle may have changed cell within one
+      uint64_t *t = grid.key; grid.key = grid.key2; grid.key2 = t;
+    }
+
+  grid.valid = 1;
+}
+
+
+/**
+ * @brief Forces between the particle in sorted position i and those in
+ * sorted positions j0 .. j1 that are in the cell of key.
+ */
+static inline void particle_pairs ( const size_t i, const size_t j0, const size_t j1,
+				    const uint64_t key, const double rc2, const double ron2 )
+{
+  double   * restrict x  = grid.x;
+  double   * restrict y  = grid.y;
+  double   * restrict z  = grid.z;
+  double   * restrict m  = grid.m;
+  double   * restrict fx = grid.fx;
+  double   * restrict fy = grid.fy;
+  double   * restrict fz = grid.fz;
+  uint64_t * restrict kj = grid.key;
+
+  const double inv_band = 1.0 / (rc2 - ron2);
+  const double xi  = x[i];
+  const double yi  = y[i];
+  const double zi  = z[i];
+  const double mGi = m[i]*G;
+
+  double fxi = 0;
+  double fyi = 0;
+  double fzi = 0;
+
+  unsigned long long examined = 0, inside = 0;
+
+  for ( size_t j = j0; j < j1; j++ )
+    {
+      if ( kj[j] != key )
+	continue;
+      examined++;
+
+      double dx = x[j] - xi;
+      double dy = y[j] - yi;
+      double dz = z[j] - zi;
+      double r2 = dx * dx + dy * dy + dz * dz;
+      if ( r2 >= rc2 )
+	continue;
+      inside++;
+
+      double inv_dist  = 1.0 / sqrt( r2 + epsilon_sq );
+      double force_mag = mGi * m[j] * inv_dist * inv_dist * inv_dist;
+      if ( r2 > ron2 )
+	{
+	  double s = (rc2 - r2) * inv_band;
+	  force_mag *= s * s * (3 - 2*s);
+	}
+
+      double _fx = force_mag * dx;
+      double _fy = force_mag * dy;
+      double _fz = force_mag * dz;
+      fxi += _fx;
+      fyi += _fy;
+      fzi += _fz;
+      fx[j] -= _fx;
+      fy[j] -= _fy;
+      fz[j] -= _fz;
+    }
+
+  fx[i] += fxi;
+  fy[i] += fyi;
+  fz[i] += fzi;
+
+  npairs    += examined;
+  ninteract += inside;
+}
+
+
+/**
+ * @brief Forces with cutoff radius rc, on a cell list.
+ */
+void compute_forces_cells ( particle_t * restrict P, const size_t N, const double rc )
+{
+  if ( N == 0 )
+    return;
+
+  double tstart = WALL_TIME;
+  allocate( N );
+  update_grid( P, N, rc );
+
+  for ( size_t k = 0; k < N; k++ )
+    {
+      size_t i = grid.idx[k];
+      grid.x[k] = PX(P,i);
+      grid.y[k] = PY(P,i);
+      grid.z[k] = PZ(P,i);
+      grid.m[k] = PM(P,i);
+      grid.fx[k] = grid.fy[k] = grid.fz[k] = 0.0;
+    }
+  wtime_grid += WALL_TIME - tstart;
+
+  const double rc2  = rc * rc;
+  const double ron2 = RON_FRACTION * RON_FRACTION * rc2;
+
+  for ( size_t k = 0; k < N; k++ )
+    {
+      // the cell itself and the half shell of the neighbours that come
+      // after it, so that every pair of cells is visited once; in its own
+      // cell, the particle k meets the ones that come after it only
+      for ( int dz = 0; dz <= 1; dz++ )
+	for ( int dy = ( dz ? -1 : 0 ); dy <= 1; dy++ )
+	  for ( int dx = ( (dz || dy) ? -1 : 0 ); dx <= 1; dx++ )
+	    {
+	      uint64_t key = neighbour_key( grid.key[k], dx, dy, dz );
+	      size_t   b   = bucket_of( key );
+	      particle_pairs( k, ( (dx || dy || dz) ? grid.start[b] : k + 1 ), grid.start[b+1],
+			      key, rc2, ron2 );
+	    }
+    }
+
+  for ( size_t k = 0; k < N; k++ )
+    {
+      size_t i = grid.idx[k];
+      PFX(P,i) = grid.fx[k];
+      PFY(P,i) = grid.fy[k];
+      PFZ(P,i) = grid.fz[k];
+    }
+  ncalls++;
+}
+
+
+/**
+ * @brief Forces with cutoff radius rc on the active particles only, for the
+ * sub-steps of the leapfrog. The cell list is brought up to date with all
+ * the particles, then every active particle sums over the 27 cells around
+ * its own: no Newton's third law, the inactive particles must not
+ * accumulate forces. Each active particle is independent, hence the
+ * parallel for.
+ */
+void compute_forces_cells_active ( particle_t * restrict P, const size_t N, const double rc,
+				   const size_t * restrict active_indexes, const size_t Nactive )
+{
+  if ( N == 0 )
+    return;
+
+  double tstart = WALL_TIME;
+  allocate( N );
+  update_grid( P, N, rc );
+
+  for ( size_t k = 0; k < N; k++ )
+    {
+      size_t i = grid.idx[k];
+      grid.x[k] = PX(P,i);
+      grid.y[k] = PY(P,i);
+      grid.z[k] = PZ(P,i);
+      grid.m[k] = PM(P,i);
+    }
+  wtime_grid += WALL_TIME - tstart;
+
+  const double   * restrict x  = grid.x;
+  const double   * restrict y  = grid.y;
+  const double   * restrict z  = grid.z;
+  const double   * restrict m  = grid.m;
+  const uint64_t * restrict kj = grid.key;
+  const double rc2      = rc * rc;
+  const double ron2     = RON_FRACTION * RON_FRACTION * rc2;
+  const double inv_band = 1.0 / (rc2 - ron2);
+
+  unsigned long long examined = 0, inside = 0;
+
+ #pragma omp parallel for schedule(dynamic, 16) reduction(+:examined,inside)
+  for ( size_t k = 0; k < Nactive; k++ )
+    {
+      const size_t   i    = active_indexes[k];
+      const double   xi   = PX(P,i);
+      const double   yi   = PY(P,i);
+      const double   zi   = PZ(P,i);
+      const double   mGi  = PM(P,i)*G;
+      const uint64_t keyi = key_of( P, i );
+
+      double fxi = 0;
+      double fyi = 0;
+      double fzi = 0;
+
+      for ( int cz = -1; cz <= 1; cz++ )
+	for ( int cy = -1; cy <= 1; cy++ )
+	  for ( int cx = -1; cx <= 1; cx++ )
+	    {
+	      uint64_t key = neighbour_key( keyi, cx, cy, cz );
+	      size_t   b   = bucket_of( key );
+
+	      for ( size_t j = grid.start[b]; j < grid.start[b+1]; j++ )
+		{
+		  if ( kj[j] != key )
+		    continue;
+		  examined++;
+
+		  double dx = x[j] - xi;
+		  double dy = y[j] - yi;
+		  double dz = z[j] - zi;
+		  double r2 = dx * dx + dy * dy + dz * dz;
+		  if ( (r2 >= rc2) || (grid.idx[j] == i) )
+		    continue;
+		  inside++;
+
+		  double inv_dist  = 1.0 / sqrt( r2 + epsilon_sq );
+		  double force_mag = mGi * m[j] * inv_dist * inv_dist * inv_dist;
+		  if ( r2 > ron2 )
+		    {
+		      double s = (rc2 - r2) * inv_band;
+		      force_mag *= s * s * (3 - 2*s);
+		    }
+		  fxi += force_mag * dx;
+		  fyi += force_mag * dy;
+		  fzi += force_mag * dz;
+		}
+	    }
+
+      PFX(P,i) = fxi;
+      PFY(P,i) = fyi;
+      PFZ(P,i) = fzi;
+    }
+
+  nactive_calls++;
+  nactive   += Nactive;
+  apairs    += examined;
+  ainteract += inside;
+}
+
+
+/**
+ * @brief The particles have been reordered (see sfc_reorder()): the sorted
+ * order refers to the old positions, and is rebuilt from scratch.
+ */
+void cells_invalidate ( void )
+{
+  for ( size_t k = 0; k < grid.N; k++ )
+    grid.idx[k] = k;
+  grid.valid = 0;
+}
+
+
+void cells_report ( const size_t N, const double wtime )
+{
+  if ( ncalls + nactive_calls == 0 )
+    return;
+
+  size_t occupied = 0;
+  for ( size_t b = 0; b < grid.nbuckets; b++ )
+    occupied += ( grid.start[b+1] > grid.start[b] );
+
+  double allpairs = (double)N * (N-1) / 2 * ncalls;
+  printf("Cell list: cells of side %g hashed in %llu buckets, %llu occupied at the end,"
+	 " %g particles per occupied bucket\n",
+	 grid.rc, (unsigned long long)grid.nbuckets, (unsigned long long)occupied,
+	 (double)N / occupied );
+  if ( nactive_calls > 0 )
+    printf("           %llu passes on the active particles, %g particles each: %g partners"
+	   " within the cutoff and %g examined per particle, %g Minteractions/s\n",
+	   nactive_calls, (double)nactive / nactive_calls, (double)ainteract / nactive,
+	   (double)apairs / nactive, ainteract / wtime * 1e-6 );
+  if ( ncalls > 0 )
+    {
+      printf("           %g pairs within the cutoff and %g examined per step (%g%% of all the pairs)\n",
+	     (double)ninteract / ncalls, (double)npairs / ncalls, 100.0 * npairs / allpairs );
+      printf("           %g Minteractions/s within the cutoff, %g Mpairs/s examined,"
+	     " %g Ginteractions/s all-pairs equivalent\n",
+	     ninteract / wtime * 1e-6, npairs / wtime * 1e-6, allpairs / wtime * 1e-9 );
+    }
+  printf("           table: %llu rebuilds from scratch, %llu re-sorts, %llu passes with no change;"
+	 " %g s in the binning\n",
+	 nrebuilds, nsorts, ncalls + nactive_calls - nrebuilds - nsorts, wtime_grid );
+}
+
+
+void cells_release ( void )
+{
+  free ( grid.x );
+  free ( grid.imem );
+  free ( grid.kmem );
+  free ( grid.start );
+  memset( &grid, 0, sizeof(grid) );
+}
@@ -0,0 +1,256 @@
+/**
+ * @file nbody_diag.c
+ * @brief Energy, momentum and angular momentum monitor.
+ *
+ * Total energy, momentum and angular momentum are conserved by the
+ * equations of motion, and their drift measures the error of the
+ * integration: of the timestep, of the force approximations (tree, mixed
+ * precision) and of the round-off. The first measure is the reference;
+ * every following one is reported as
+ *
+ *      dE = |E - E0| / |E0|       dp = |p - p0| / sum_i m_i |v_i|
+ *                                 dL = |L - L0| / sum_i m_i |r_i x v_i|
+ *
+ * the momenta being normalized to the total "amount of motion", since the
+ * total momenta themselves start close to zero. The potential energy is the
+ * one of the softened force used everywhere,
+ *
+ *      U = - sum_{i<j} G m_i m_j / sqrt( r_ij^2 + epsilon_sq )
+ *
+ * and costs O(N^2), as a force computation. So the direct engines compute
+ * it in the same pass as the forces, when asked to (compute_forces_potential()
+ * and compute_forces_omp_potential()), for one more multiply-add per pair,
+ * and hand it to diag_monitor_potential(): what is left is an O(N) pass for
+ * the kinetic energy and the momenta. With the other engines, or when the
+ * forces are not computed on the state to be measured, diag_monitor() runs
+ * the O(N^2) pass by itself.
+ *
+ * Every measure can also be appended to a binary time series (diag_open()),
+ * a header followed by one fixed-size record per measure:
+ *
+ *      header   char magic[8] = "NBODYTS1", uint64 N, uint64 record size
+ *      record   int64 step, double time, K, U, px, py, pz, Lx, Ly, Lz
+ *
+ * all in the native byte order; with numpy, for instance,
+ *
+ *      np.fromfile( name, offset=24, dtype=[('step','i8')] +
+ *                   [(f,'f8') for f in ('t','K','U','px','py','pz','Lx','Ly','Lz')] )
+ */
+
+#include "Nbody.h"
+
+#include <stdint.h>
+
+#define TS_MAGIC   "NBODYTS1"
+
+typedef struct {
+  int64_t step;
+  double  time;
+  double  K, U;
+  double  p[3];
+  double  L[3];
+} diag_record_t;
+
+
+static int    nmeasures = 0;
+static double E0;
+static double p0[3];
+static double L0[3];
+static double max_dE = 0;
+static double max_dp = 0;
+static double max_dL = 0;
+static int    nfused = 0;       // measures whose U came from the force pass
+
+static FILE  *ts     = NULL;    // the time series
+static char   ts_name[1024];
+
+
+/**
+ * @brief Kinetic energy, momentum and angular momentum of the particles,
+ * in one O(N) pass.
+ * @param scale  sum of m_i |v_i| and sum of m_i |r_i x v_i|, the scales of
+ *               the momenta
+ */
+static void measure_kinetic ( particle_t * restrict P, const size_t N,
+			      double *K, double p[3], double L[3], double scale[2] )
+{
+  double k = 0;
+  double px = 0, py = 0, pz = 0, ps = 0;
+  double Lx = 0, Ly = 0, Lz = 0, Ls = 0;
+
+ #pragma omp parallel for schedule(static) reduction(+:k,px,py,pz,ps,Lx,Ly,Lz,Ls)
+  for ( size_t i = 0; i < N; i++ )
+    {
+      const double m  = PM(P,i);
+      const double vx = PVX(P,i);
+      const double vy = PVY(P,i);
+      const double vz = PVZ(P,i);
+      const double v2 = vx*vx + vy*vy + vz*vz;
+      k  += 0.5 * m * v2;
+      px += m * vx;
+      py += m * vy;
+      pz += m * vz;
+      ps += m * sqrt( v2 );
+
+      const double lx = PY(P,i)*vz - PZ(P,i)*vy;
+      const double ly = PZ(P,i)*vx - PX(P,i)*vz;
+      const double lz = PX(P,i)*vy - PY(P,i)*vx;
+      Lx += m * lx;
+      Ly += m * ly;
+      Lz += m * lz;
+      Ls += m * sqrt( lx*lx + ly*ly + lz*lz );
+    }
+
+  *K   = k;
+  p[0] = px; p[1] = py; p[2] = pz;
+  L[0] = Lx; L[1] = Ly; L[2] = Lz;
+  scale[0] = ps;
+  scale[1] = Ls;
+}
+
+
+/**
+ * @brief The softened potential energy, in an O(N^2) pass.
+ */
+static double measure_potential ( particle_t * restrict P, const size_t N )
+{
+  double U = 0;
+
+ #pragma omp parallel for schedule(dynamic, 16) reduction(+:U)
+  for ( size_t i = 0; i < N; i++ )
+    {
+      const double x  = PX(P,i);
+      const double y  = PY(P,i);
+      const double z  = PZ(P,i);
+      double u = 0;
+      for ( size_t j = i + 1; j < N; j++ )
+	{
+	  double dx = PX(P,j) - x;
+	  double dy = PY(P,j) - y;
+	  double dz = PZ(P,j) - z;
+	  u += PM(P,j) / sqrt( dx * dx + dy * dy + dz * dz + epsilon_sq );
+	}
+      U -= G * PM(P,i) * u;
+    }
+
+  return U;
+}
+
+
+static inline double drift ( const double a[3], const double a0[3], const double scale )
+{
+  double dx = a[0] - a0[0];
+  double dy = a[1] - a0[1];
+  double dz = a[2] - a0[2];
+  double d  = sqrt( dx*dx + dy*dy + dz*dz );
+  return ( scale > 0 ? d / scale : d );
+}
+
+
+/**
+ * @brief Measures energy and momenta, given the potential energy U of the
+ * same state, prints their drift from the first measure and appends them to
+ * the time series.
+ */
+static void record ( particle_t * restrict P, const size_t N,
+		     const int step, const double time, const double U )
+{
+  diag_record_t R;
+  double        scale[2];
+  measure_kinetic( P, N, &R.K, R.p, R.L, scale );
+  R.step = step;
+  R.time = time;
+  R.U    = U;
+
+  if ( (ts != NULL) && (fwrite( &R, sizeof(R), 1, ts ) != 1) ) {
+    fprintf( stderr, "error writing the time series %s, not written any more\n", ts_name );
+    fclose( ts );
+    ts = NULL; }
+  else if ( ts != NULL )
+    // one record every so many steps: keep the file readable while running
+    fflush( ts );
+
+  const double E = R.K + R.U;
+  if ( nmeasures++ == 0 )
+    {
+      E0 = E;
+      p0[0] = R.p[0]; p0[1] = R.p[1]; p0[2] = R.p[2];
+      L0[0] = R.L[0]; L0[1] = R.L[1]; L0[2] = R.L[2];
+      printf("step %d : energy %g, momentum (%g, %g, %g), angular momentum (%g, %g, %g)\n",
+	     step, E, R.p[0], R.p[1], R.p[2], R.L[0], R.L[1], R.L[2] );
+      return;
+    }
+
+  double dE = ( E0 != 0 ? fabs( (E - E0) / E0 ) : fabs( E - E0 ) );
+  double dp = drift( R.p, p0, scale[0] );
+  double dL = drift( R.L, L0, scale[1] );
+
+  max_dE = ( dE > max_dE ? dE : max_dE );
+  max_dp = ( dp > max_dp ? dp : max_dp );
+  max_dL = ( dL > max_dL ? dL : max_dL );
+
+  printf("step %d : energy %g, relative drift %g; momentum drift %g; angular momentum drift %g\n",
+	 step, E, dE, dp, dL );
+}
+
+
+/**
+ * @brief Measures the particles at step, with the potential energy U
+ * computed in the force pass.
+ */
+void diag_monitor_potential ( particle_t * restrict P, const size_t N,
+			      const int step, const double time, const double U )
+{
+  nfused++;
+  record( P, N, step, time, U );
+}
+
+
+/**
+ * @brief Measures the particles at step, computing the potential energy.
+ */
+void diag_monitor ( particle_t * restrict P, const size_t N, const int step, const double time )
+{
+  record( P, N, step, time, measure_potential( P, N ) );
+}
+
+
+/**
+ * @brief Starts the binary time series of the measures in fname.
+ * @return 0 on success
+ */
+int diag_open ( const char *fname, const size_t N )
+{
+  ts = fopen( fname, "wb" );
+  if ( ts == NULL ) {
+    fprintf( stderr, "unable to open the time series %s\n", fname );
+    return 1; }
+  snprintf( ts_name, sizeof(ts_name), "%s", fname );
+
+  uint64_t head[2] = { N, sizeof(diag_record_t) };
+  if ( (fwrite( TS_MAGIC, 8, 1, ts ) != 1) || (fwrite( head, sizeof(head), 1, ts ) != 1) ) {
+    fprintf( stderr, "error writing the time series %s\n", fname );
+    fclose( ts );
+    ts = NULL;
+    return 1; }
+  return 0;
+}
+
+
+void diag_report ( void )
+{
+  if ( nmeasures > 1 )
+    printf("Conservation: max energy drift %g, max momentum drift %g, max angular momentum"
+	   " drift %g over %d measures (%d with the potential from the force pass)\n",
+	   max_dE, max_dp, max_dL, nmeasures, nfused );
+  if ( ts != NULL )
+    printf("Time series of the %d measures written to %s\n", nmeasures, ts_name );
+}
+
+
+void diag_release ( void )
+{
+  if ( ts != NULL )
+    fclose( ts );
+  ts = NULL;
+}
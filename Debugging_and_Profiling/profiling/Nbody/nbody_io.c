@@ -0,0 +1,308 @@
+/**
+ * @file nbody_io.c
+ * @brief Binary checkpoints, written in the background, and restart.
+ *
+ * A checkpoint file is
+ *
+ *     | header | x | y | z | vx | vy | vz | mass | fx | fy | fz |
+ *
+ * with a fixed-size header (N, step, time, seed, the layout of the run that
+ * wrote it and the offset of every field) followed by one contiguous array
+ * of N doubles per field, each starting on a CKPT_ALIGN boundary. Being
+ * per-field, the file maps directly on the SoA arrays and is read field by
+ * field into any other layout, whatever the layout that wrote it. The
+ * particles are stored in their original order (see sfc_ids()), so that a
+ * run that reorders them writes the same file as one that does not.
+ *
+ * Writing must not stall the step loop: the particles are copied into a
+ * staging buffer that is already the image of the file, which costs one
+ * pass over the data, and a background thread writes it with large
+ * aligned write()s while the loop goes on. The file is written under a
+ * temporary name and renamed when complete, so that the previous checkpoint
+ * stays valid until the new one is safely on disk. The loop waits only if a
+ * checkpoint is requested while the previous one is still being written.
+ *
+ * Reading maps the file with mmap() and copies the fields into place.
+ */
+
+#include "Nbody.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CKPT_MAGIC    "NBODYCK1"
+#define CKPT_VERSION  1
+#define CKPT_NFIELDS  10
+#define CKPT_ALIGN    4096                  // header and fields start on a page
+#define CKPT_CHUNK    (8 << 20)             // bytes per write()
+
+#define ALIGN_UP(n)   ( ((n) + CKPT_ALIGN - 1) / CKPT_ALIGN * CKPT_ALIGN )
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t layout;                          // LAYOUT_ID of the writer, for information
+  uint64_t N;
+  uint64_t step;
+  double   time;
+  int64_t  seed;
+  uint64_t nfields;
+  uint64_t offset[CKPT_NFIELDS];            // in bytes from the beginning of the file
+} ckpt_header_t;
+
+
+static char       *stage      = NULL;       // the image of the file
+static size_t      stage_size = 0;
+static char        stage_name[1024];
+static pthread_t   writer;
+static int         writing    = 0;          // a writer thread is running
+static int         write_err  = 0;
+
+static int         nwritten   = 0;
+static double      wtime_copy = 0;          // spent by the step loop
+static double      wtime_wait = 0;
+static double      wtime_io   = 0;          // spent by the writer thread
+
+
+static inline size_t file_size ( const size_t N )
+{
+  return ALIGN_UP( sizeof(ckpt_header_t) ) + CKPT_NFIELDS * ALIGN_UP( N * sizeof(double) );
+}
+
+
+static void *write_stage ( void *arg )
+{
+  (void)arg;
+  double tstart = WALL_TIME;
+  char   tmpname[1040];
+  snprintf( tmpname, sizeof(tmpname), "%s.tmp", stage_name );
+
+  int fd = open( tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 ) {
+    write_err = 1;
+    return NULL; }
+
+  size_t done = 0;
+  while ( done < stage_size )
+    {
+      size_t  len = ( stage_size - done < CKPT_CHUNK ? stage_size - done : CKPT_CHUNK );
+      ssize_t ret = write( fd, stage + done, len );
+      if ( ret < 0 ) {
+	write_err = 1;
+	break; }
+      done += (size_t)ret;
+    }
+
+  if ( fsync( fd ) != 0 )
+    write_err = 1;
+  close( fd );
+  if ( !write_err && (rename( tmpname, stage_name ) != 0) )
+    write_err = 1;
+
+  wtime_io += WALL_TIME - tstart;
+  return NULL;
+}
+
+
+/**
+ * @brief Waits for the checkpoint being written, if any.
+ * @return 0 if all the checkpoints have been written successfully
+ */
+int checkpoint_wait ( void )
+{
+  if ( writing )
+    {
+      double tstart = WALL_TIME;
+      pthread_join( writer, NULL );
+      wtime_wait += WALL_TIME - tstart;
+      writing = 0;
+      if ( write_err )
+	fprintf( stderr, "error writing the checkpoint %s\n", stage_name );
+    }
+  return write_err;
+}
+
+
+/**
+ * @brief Starts writing a checkpoint of the particles to fname.
+ * The particles can be modified as soon as the function returns.
+ */
+int checkpoint_write ( particle_t * restrict P, const size_t N, const long step,
+		       const double time, const long seed, const char *fname )
+{
+  checkpoint_wait();
+
+  double tstart = WALL_TIME;
+  size_t size   = file_size( N );
+  if ( size > stage_size )
+    {
+      free ( stage );
+      stage = (char*)aligned_alloc( CKPT_ALIGN, size );
+      if ( stage == NULL ) {
+	fprintf( stderr, "unable to allocate %zu bytes for the checkpoint\n", size );
+	stage_size = 0;
+	return 1; }
+    }
+  stage_size = size;
+  snprintf( stage_name, sizeof(stage_name), "%s", fname );
+
+  ckpt_header_t *H = (ckpt_header_t*)stage;
+  memset( stage, 0, ALIGN_UP( sizeof(ckpt_header_t) ) );
+  memcpy( H->magic, CKPT_MAGIC, 8 );
+  H->version = CKPT_VERSION;
+  H->layout  = LAYOUT_ID;
+  H->N       = N;
+  H->step    = step;
+  H->time    = time;
+  H->seed    = seed;
+  H->nfields = CKPT_NFIELDS;
+
+  double *F[CKPT_NFIELDS];
+  for ( int f = 0; f < CKPT_NFIELDS; f++ )
+    {
+      H->offset[f] = ALIGN_UP( sizeof(ckpt_header_t) ) + f * ALIGN_UP( N * sizeof(double) );
+      F[f] = (double*)( stage + H->offset[f] );
+    }
+
+  // the particle in i was originally the ids[i]-th
+  const size_t *ids = sfc_ids();
+ #pragma omp parallel for schedule(static)
+  for ( size_t i = 0; i < N; i++ )
+    {
+      size_t k = ( ids != NULL ? ids[i] : i );
+      F[0][k] = PX(P,i);  F[1][k] = PY(P,i);  F[2][k] = PZ(P,i);
+      F[3][k] = PVX(P,i); F[4][k] = PVY(P,i); F[5][k] = PVZ(P,i);
+      F[6][k] = PM(P,i);
+      F[7][k] = PFX(P,i); F[8][k] = PFY(P,i); F[9][k] = PFZ(P,i);
+    }
+  wtime_copy += WALL_TIME - tstart;
+
+  write_err = 0;
+  if ( pthread_create( &writer, NULL, write_stage, NULL ) != 0 )
+    {
+      // no thread: write it synchronously
+      write_stage( NULL );
+      nwritten++;
+      return write_err;
+    }
+  writing = 1;
+  nwritten++;
+  return 0;
+}
+
+
+/**
+ * @brief Maps a checkpoint and checks its header.
+ * @return the mapped file, NULL on failure
+ */
+static const char *map_checkpoint ( const char *fname, size_t *size )
+{
+  int fd = open( fname, O_RDONLY );
+  if ( fd < 0 ) {
+    fprintf( stderr, "unable to open the checkpoint %s\n", fname );
+    return NULL; }
+
+  struct stat st;
+  if ( (fstat( fd, &st ) != 0) || ((size_t)st.st_size < sizeof(ckpt_header_t)) ) {
+    fprintf( stderr, "%s is not a checkpoint\n", fname );
+    close( fd );
+    return NULL; }
+
+  const char *map = (const char*)mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    fprintf( stderr, "unable to map the checkpoint %s\n", fname );
+    return NULL; }
+
+  const ckpt_header_t *H = (const ckpt_header_t*)map;
+  if ( (memcmp( H->magic, CKPT_MAGIC, 8 ) != 0) || (H->version != CKPT_VERSION) ||
+       (H->nfields != CKPT_NFIELDS) || ((size_t)st.st_size < file_size( H->N )) )
+    {
+      fprintf( stderr, "%s is not a valid checkpoint\n", fname );
+      munmap( (void*)map, st.st_size );
+      return NULL;
+    }
+
+  *size = st.st_size;
+  return map;
+}
+
+
+/**
+ * @brief Reads the header of a checkpoint.
+ * @return 0 on success
+ */
+int checkpoint_info ( const char *fname, size_t *N, long *step, double *time, long *seed )
+{
+  size_t      size;
+  const char *map = map_checkpoint( fname, &size );
+  if ( map == NULL )
+    return 1;
+
+  const ckpt_header_t *H = (const ckpt_header_t*)map;
+  *N    = H->N;
+  *step = H->step;
+  *time = H->time;
+  *seed = H->seed;
+  munmap( (void*)map, size );
+  return 0;
+}
+
+
+/**
+ * @brief Reads the particles of a checkpoint into P, that must hold N of them.
+ * @return 0 on success
+ */
+int checkpoint_read ( const char *fname, particle_t * restrict P, const size_t N )
+{
+  size_t      size;
+  const char *map = map_checkpoint( fname, &size );
+  if ( map == NULL )
+    return 1;
+
+  const ckpt_header_t *H = (const ckpt_header_t*)map;
+  if ( H->N != N ) {
+    fprintf( stderr, "the checkpoint %s has %llu particles instead of %llu\n",
+	     fname, (unsigned long long)H->N, (unsigned long long)N );
+    munmap( (void*)map, size );
+    return 1; }
+
+  const double *F[CKPT_NFIELDS];
+  for ( int f = 0; f < CKPT_NFIELDS; f++ )
+    F[f] = (const double*)( map + H->offset[f] );
+
+ #pragma omp parallel for schedule(static)
+  for ( size_t i = 0; i < N; i++ )
+    {
+      PX(P,i)  = F[0][i]; PY(P,i)  = F[1][i]; PZ(P,i)  = F[2][i];
+      PVX(P,i) = F[3][i]; PVY(P,i) = F[4][i]; PVZ(P,i) = F[5][i];
+      PM(P,i)  = F[6][i];
+      PFX(P,i) = F[7][i]; PFY(P,i) = F[8][i]; PFZ(P,i) = F[9][i];
+    }
+
+  munmap( (void*)map, size );
+  return 0;
+}
+
+
+void checkpoint_report ( void )
+{
+  if ( nwritten == 0 )
+    return;
+  printf("Checkpoints: %d written, %g MB each; step loop stalled %g s (copy) + %g s (wait),"
+	 " %g s written in the background\n",
+	 nwritten, stage_size / 1048576.0, wtime_copy, wtime_wait, wtime_io );
+}
+
+
+void checkpoint_release ( void )
+{
+  checkpoint_wait();
+  free ( stage );
+  stage      = NULL;
+  stage_size = 0;
+}
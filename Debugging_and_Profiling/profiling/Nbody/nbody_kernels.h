@@ -0,0 +1,136 @@
+/**
+ * @file nbody_kernels.h
+ * @brief The serial kernels, written once for all the data layouts.
+ *
+ * This is a poor man's template: there is no include guard, and the file
+ * is meant to be included after defining
+ *
+ *   KTYPE           the particle type (the kernels take a KTYPE*)
+ *   KFIELD(P,i,f)   the access to the field f of particle i
+ *   KSUFFIX         appended to the names of the functions (can be empty)
+ *   KSTORAGE        their storage class (can be empty)
+ *
+ * which are undefined at the end, so that it can be included again for
+ * another layout. Nbody.c instantiates it for the layout chosen at compile
+ * time, nbody_layouts.c for all of them.
+ */
+
+#define KCAT_(a,b)  a ## b
+#define KCAT(a,b)   KCAT_(a,b)
+#define KNAME(f)    KCAT(f, KSUFFIX)
+
+
+/**
+ * @brief The core computational kernel. Calculates the gravitational forces.
+ * This is where the O(N^2) complexity lies and where the performance
+ * difference between the layouts is most apparent.
+ * With want_U it also returns the potential energy, which costs one more
+ * multiply-add per pair; want_U is a constant at every call, so that the
+ * compiler generates the loop without it for compute_forces().
+ */
+
+static inline double KNAME(forces_potential) ( KTYPE * restrict P, const size_t N, const int want_U )
+{
+  double U = 0;
+
+  for ( size_t i = 0; i < N; i++)
+    KFIELD(P,i,fx) = KFIELD(P,i,fy) = KFIELD(P,i,fz) = 0.0;
+
+  for ( size_t i = 0; i < N; i++ )
+    {
+      const double x  = KFIELD(P,i,x);
+      const double y  = KFIELD(P,i,y);
+      const double z  = KFIELD(P,i,z);
+      const double mG = KFIELD(P,i,mass)*G;
+
+      double fx = 0;
+      double fy = 0;
+      double fz = 0;
+      double u  = 0;
+
+      for (size_t j = i + 1; j < N; j++)
+	{
+	  double dx = KFIELD(P,j,x) - x;
+	  double dy = KFIELD(P,j,y) - y;
+	  double dz = KFIELD(P,j,z) - z;
+
+	  double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
+	  double inv_dist = 1.0 / sqrt(dist_sq);
+	  double inv_dist_cubed = inv_dist * inv_dist * inv_dist;
+
+	  double force_mag = mG * KFIELD(P,j,mass) * inv_dist_cubed;
+
+	  double _fx = force_mag * dx;
+	  double _fy = force_mag * dy;
+	  double _fz = force_mag * dz;
+
+	  fx += _fx;
+	  fy += _fy;
+	  fz += _fz;
+	  if ( want_U )
+	    u += KFIELD(P,j,mass) * inv_dist;
+
+	  KFIELD(P,j,fx) -= _fx;
+	  KFIELD(P,j,fy) -= _fy;
+	  KFIELD(P,j,fz) -= _fz;
+	}
+
+      // the j < i contributions have already been subtracted
+      KFIELD(P,i,fx) += fx;
+      KFIELD(P,i,fy) += fy;
+      KFIELD(P,i,fz) += fz;
+      U -= mG * u;
+    }
+
+  return U;
+}
+
+
+KSTORAGE void KNAME(compute_forces) ( KTYPE * restrict P, const size_t N )
+{
+  KNAME(forces_potential)( P, N, 0 );
+}
+
+
+/**
+ * @brief The forces, as compute_forces(), and the potential energy
+ * - sum_{i<j} G m_i m_j / sqrt( r_ij^2 + epsilon_sq ), which is returned.
+ */
+
+KSTORAGE double KNAME(compute_forces_potential) ( KTYPE * restrict P, const size_t N )
+{
+  return KNAME(forces_potential)( P, N, 1 );
+}
+
+
+/**
+ * @brief Updates the velocities and positions of all bodies based on the
+ * computed forces using a simple Euler integration step.
+ */
+
+KSTORAGE void KNAME(update_particles) ( KTYPE * P, size_t N, double dt )
+{
+  for ( size_t i = 0; i < N; i++ )
+    {
+      double mass_r = 1.0 / KFIELD(P,i,mass);
+
+      // Update velocity
+      KFIELD(P,i,vx) += KFIELD(P,i,fx) * mass_r * dt;
+      KFIELD(P,i,vy) += KFIELD(P,i,fy) * mass_r * dt;
+      KFIELD(P,i,vz) += KFIELD(P,i,fz) * mass_r * dt;
+
+      // Update position
+      KFIELD(P,i,x) += KFIELD(P,i,vx) * dt;
+      KFIELD(P,i,y) += KFIELD(P,i,vy) * dt;
+      KFIELD(P,i,z) += KFIELD(P,i,vz) * dt;
+    }
+}
+
+
+#undef KNAME
+#undef KCAT
+#undef KCAT_
+#undef KTYPE
+#undef KFIELD
+#undef KSUFFIX
+#undef KSTORAGE
@@ -0,0 +1,158 @@
+/**
+ * @file nbody_layouts.c
+ * @brief Side-by-side comparison of the AoS, SoA, AoSoA and hot/cold layouts.
+ *
+ * The serial kernel of nbody_kernels.h is instantiated once per layout, and
+ * run on copies of the same particles, so that the layouts are compared in
+ * the same run, on the same data and with the same compiler.
+ *
+ * Besides the GFLOP/s, the bytes per interaction are reported: those of the
+ * cache lines that the j loop moves for every interaction. Every j-particle
+ * is read for x, y, z, mass and fx, fy, fz and written for fx, fy, fz:
+ *  - with AoS a whole particle (80 bytes) comes in and goes back dirty,
+ *    velocities included;
+ *  - with SoA, AoSoA and the hot/cold split only the 7 fields that are used
+ *    come in (56 bytes) and the 3 forces go back (24 bytes).
+ * The last three move the same bytes, with a different number of memory
+ * streams: seven for SoA, two for the split layout, one for AoSoA.
+ */
+
+#include "Nbody.h"
+
+#define NLAYOUTS                     4
+
+
+// the serial kernel, once per layout
+//
+#define KTYPE    particle_aos_t
+#define KFIELD   AOS_FIELD
+#define KSUFFIX  _aos
+#define KSTORAGE static __attribute__((unused))   // update_particles is not needed here
+#include "nbody_kernels.h"
+
+#define KTYPE    particle_soa_t
+#define KFIELD   SOA_FIELD
+#define KSUFFIX  _soa
+#define KSTORAGE static __attribute__((unused))
+#include "nbody_kernels.h"
+
+#define KTYPE    particle_aosoa_t
+#define KFIELD   AOSOA_FIELD
+#define KSUFFIX  _aosoa
+#define KSTORAGE static __attribute__((unused))
+#include "nbody_kernels.h"
+
+#define KTYPE    particle_split_t
+#define KFIELD   SPLIT_FIELD
+#define KSUFFIX  _split
+#define KSTORAGE static __attribute__((unused))
+#include "nbody_kernels.h"
+
+
+// copies positions and masses of the particles in P into the layout L
+#define COPY_PARTICLES( L, DST ) {					\
+    for ( size_t i = 0; i < N; i++ ) {					\
+      L(DST,i,x) = PX(P,i); L(DST,i,y) = PY(P,i); L(DST,i,z) = PZ(P,i); \
+      L(DST,i,mass) = PM(P,i); } }
+
+// the largest relative difference of the forces in DST from those in ref
+#define FORCE_DIFF( L, DST, ref, diff ) {				\
+    for ( size_t i = 0; i < N; i++ ) {					\
+      double d  = fabs( L(DST,i,fx) - AOS_FIELD(ref,i,fx) ) +		\
+	fabs( L(DST,i,fy) - AOS_FIELD(ref,i,fy) ) +			\
+	fabs( L(DST,i,fz) - AOS_FIELD(ref,i,fz) );			\
+      double f  = fabs( AOS_FIELD(ref,i,fx) ) + fabs( AOS_FIELD(ref,i,fy) ) + \
+	fabs( AOS_FIELD(ref,i,fz) );					\
+      if ( f > 0 && d / f > (diff) ) (diff) = d / f; } }
+
+
+/**
+ * @brief Runs the direct summation nrep times with every layout, on copies
+ * of the particles in P (which are not modified), and prints GFLOP/s and
+ * bytes per interaction for each of them.
+ */
+void layout_benchmark ( particle_t * restrict P, const size_t N, const int nrep )
+{
+  if ( (N < 2) || (nrep <= 0) )
+    return;
+
+  particle_aos_t   *aos   = (particle_aos_t*)calloc( N, sizeof(particle_aos_t) );
+  particle_aosoa_t *aosoa = (particle_aosoa_t*)aligned_alloc( 64, AOSOA_NBLOCKS(N) * sizeof(particle_aosoa_t) );
+  particle_soa_t    soa;
+  particle_split_t  split;
+  soa.x     = (double*)calloc( 10 * N, sizeof(double) );
+  split.hot = (particle_hot_t*)calloc( N, PARTICLE_BYTES );
+  if ( (aos == NULL) || (aosoa == NULL) || (soa.x == NULL) || (split.hot == NULL) ) {
+    fprintf( stderr, "unable to allocate the particles for the layout comparison\n" );
+    exit( 1 ); }
+  memset( aosoa, 0, AOSOA_NBLOCKS(N) * sizeof(particle_aosoa_t) );
+
+  soa.y    = soa.x + N;
+  soa.z    = soa.x + 2*N;
+  soa.vx   = soa.x + 3*N;
+  soa.vy   = soa.x + 4*N;
+  soa.vz   = soa.x + 5*N;
+  soa.mass = soa.x + 6*N;
+  soa.fx   = soa.x + 7*N;
+  soa.fy   = soa.x + 8*N;
+  soa.fz   = soa.x + 9*N;
+
+  split.vel   = (particle_vel_t*)( split.hot + N );
+  split.force = (particle_force_t*)( split.vel + N );
+
+  COPY_PARTICLES( AOS_FIELD, aos );
+  COPY_PARTICLES( SOA_FIELD, &soa );
+  COPY_PARTICLES( AOSOA_FIELD, aosoa );
+  COPY_PARTICLES( SPLIT_FIELD, &split );
+
+  double timing[NLAYOUTS];
+  double tstart;
+
+  tstart = WALL_TIME;
+  for ( int r = 0; r < nrep; r++ )
+    compute_forces_aos( aos, N );
+  timing[0] = WALL_TIME - tstart;
+
+  tstart = WALL_TIME;
+  for ( int r = 0; r < nrep; r++ )
+    compute_forces_soa( &soa, N );
+  timing[1] = WALL_TIME - tstart;
+
+  tstart = WALL_TIME;
+  for ( int r = 0; r < nrep; r++ )
+    compute_forces_aosoa( aosoa, N );
+  timing[2] = WALL_TIME - tstart;
+
+  tstart = WALL_TIME;
+  for ( int r = 0; r < nrep; r++ )
+    compute_forces_split( &split, N );
+  timing[3] = WALL_TIME - tstart;
+
+  // all the layouts perform the same operations in the same order
+  double diff_soa = 0, diff_aosoa = 0, diff_split = 0;
+  FORCE_DIFF( SOA_FIELD, &soa, aos, diff_soa );
+  FORCE_DIFF( AOSOA_FIELD, aosoa, aos, diff_aosoa );
+  FORCE_DIFF( SPLIT_FIELD, &split, aos, diff_split );
+
+  const char *name[NLAYOUTS]  = { "AoS", "SoA", "AoSoA", "hot/cold" };
+  size_t      bytes[NLAYOUTS] = { AOS_BYTES_PER_INTERACTION, SOA_BYTES_PER_INTERACTION,
+				  AOSOA_BYTES_PER_INTERACTION, SPLIT_BYTES_PER_INTERACTION };
+  double interactions  = (double)N * (N-1) / 2 * nrep;
+
+  printf("Layout comparison, %d force computations of %llu particles:\n",
+	 nrep, (unsigned long long)N );
+  printf("   layout      time (s)    GFLOP/s   bytes/interaction   GB/s\n");
+  for ( int l = 0; l < NLAYOUTS; l++ )
+    printf("   %-8s %10.4f %10.3f %19zu %8.2f\n",
+	   name[l], timing[l],
+	   FLOPS_PER_INTERACTION * interactions / timing[l] * 1e-9,
+	   bytes[l],
+	   bytes[l] * interactions / timing[l] * 1e-9 );
+  printf("   max relative force difference from AoS: %g (SoA), %g (AoSoA), %g (hot/cold)\n",
+	 diff_soa, diff_aosoa, diff_split );
+
+  free ( aos );
+  free ( aosoa );
+  free ( soa.x );
+  free ( split.hot );
+}
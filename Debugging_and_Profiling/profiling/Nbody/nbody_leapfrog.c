@@ -0,0 +1,291 @@
+/**
+ * @file nbody_leapfrog.c
+ * @brief Kick-drift-kick leapfrog with hierarchical (block) individual timesteps.
+ *
+ * Every particle lives in a timestep bin b, with
+ *
+ *      dt_b = dt_max / 2^b ,    b = 0 .. MAX_BIN
+ *
+ * and b chosen from the usual acceleration criterion
+ *
+ *      dt_i = sqrt( 2 eta eps / |a_i| )
+ *
+ * eps being the softening length. The time inside a big step dt_max is
+ * an integer, in units of dt_max / 2^MAX_BIN, so that the beginning and the
+ * end of the particles' steps are exact. At every sub-step:
+ *
+ *   - all the particles are drifted (their positions are needed anyway);
+ *   - the particles whose step ends ("active" particles) get their force
+ *     recomputed, the force being exerted by all the particles;
+ *   - the active particles are kicked by the second half of their old step,
+ *     are assigned a new bin and are kicked by the first half of the new one.
+ *
+ * A particle can move to a smaller timestep at any sub-step, but to a larger
+ * one only when the current time is a multiple of the new step, so that the
+ * hierarchy stays synchronized. At the end of a big step all the particles
+ * are synchronized and have fresh forces.
+ *
+ * The cost of a sub-step is O(Nactive * N) with the direct summation,
+ * O(N log N + Nactive log N) with the tree and O(N + Nactive * neighbours)
+ * with the cell list: the particles in quiet regions sit in the low bins
+ * and are updated rarely.
+ */
+
+#include "Nbody.h"
+
+#define MAX_BIN   20
+#define TIMEBASE  (1L << MAX_BIN)
+
+#define DTI(b)    ( TIMEBASE >> (b) )
+
+
+static int    *bin            = NULL;
+static size_t *active_indexes = NULL;
+static size_t  Nalloc         = 0;
+static int     initialized    = 0;
+
+static size_t  bin_count[MAX_BIN+1];
+
+static unsigned long long nsubsteps      = 0;
+static unsigned long long nforce_updates = 0;
+static unsigned long long nbigsteps      = 0;
+static int                maxbin_seen    = 0;
+
+
+
+/**
+ * @brief Direct summation on the active particles only.
+ * No Newton's third law here: the inactive particles must not accumulate
+ * forces. Each i is independent, hence the parallel for.
+ */
+static void compute_forces_active ( particle_t * restrict P, const size_t N,
+				    const size_t * restrict active_indexes, const size_t Nactive )
+{
+ #pragma omp parallel for schedule(dynamic, 16)
+  for ( size_t k = 0; k < Nactive; k++ )
+    {
+      size_t i = active_indexes[k];
+      const double x  = PX(P,i);
+      const double y  = PY(P,i);
+      const double z  = PZ(P,i);
+      const double mG = PM(P,i)*G;
+
+      double fx = 0;
+      double fy = 0;
+      double fz = 0;
+
+      for ( size_t j = 0; j < N; j++ )
+	{
+	  double dx = PX(P,j) - x;
+	  double dy = PY(P,j) - y;
+	  double dz = PZ(P,j) - z;
+	  double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
+	  double inv_dist = 1.0 / sqrt(dist_sq);
+	  // the self-interaction has dx = dy = dz = 0 and gives no force
+	  double force_mag = mG * PM(P,j) * inv_dist * inv_dist * inv_dist;
+	  fx += force_mag * dx;
+	  fy += force_mag * dy;
+	  fz += force_mag * dz;
+	}
+
+      PFX(P,i) = fx;
+      PFY(P,i) = fy;
+      PFZ(P,i) = fz;
+    }
+}
+
+
+static inline void active_forces ( particle_t * restrict P, const size_t N,
+				   const size_t * restrict active_indexes, const size_t Nactive,
+				   const int engine, const double theta, const double rc )
+{
+  if ( engine == FORCE_TREE )
+    compute_forces_tree_active( P, N, theta, active_indexes, Nactive );
+  else if ( engine == FORCE_CELLS )
+    compute_forces_cells_active( P, N, rc, active_indexes, Nactive );
+  else
+    compute_forces_active( P, N, active_indexes, Nactive );
+
+  nforce_updates += Nactive;
+}
+
+
+/**
+ * @brief The timestep bin suggested by the acceleration of particle i.
+ */
+static inline int timestep_bin ( particle_t * restrict P, const size_t i,
+				 const double dtmax, const double eta )
+{
+  double ax = PFX(P,i) / PM(P,i);
+  double ay = PFY(P,i) / PM(P,i);
+  double az = PFZ(P,i) / PM(P,i);
+  double a  = sqrt( ax*ax + ay*ay + az*az );
+
+  if ( a == 0 )
+    return 0;
+
+  double dt = sqrt( 2 * eta * sqrt(epsilon_sq) / a );
+  int    b  = 0;
+  while ( (b < MAX_BIN) && (dtmax / (double)(1L << b) > dt) )
+    b++;
+  return b;
+}
+
+
+static inline void kick ( particle_t * restrict P, const size_t i, const double dt )
+{
+  double mass_r = 1.0 / PM(P,i);
+  PVX(P,i) += PFX(P,i) * mass_r * dt;
+  PVY(P,i) += PFY(P,i) * mass_r * dt;
+  PVZ(P,i) += PFZ(P,i) * mass_r * dt;
+}
+
+
+/**
+ * @brief Evolves the system by one big step dt_max.
+ * @param theta  the opening angle, with the tree
+ * @param rc     the cutoff radius, with the cell list
+ */
+void leapfrog_step ( particle_t * restrict P, const size_t N, const double dtmax,
+		     const double eta, const int engine, const double theta, const double rc )
+{
+  const double dt_unit = dtmax / TIMEBASE;
+
+  if ( Nalloc != N )
+    {
+      free ( bin );
+      free ( active_indexes );
+      bin            = (int*)malloc( N * sizeof(int) );
+      active_indexes = (size_t*)malloc( N * sizeof(size_t) );
+      if ( (bin == NULL) || (active_indexes == NULL) ) {
+	fprintf( stderr, "unable to allocate the timestep bins\n" );
+	exit( 1 ); }
+      Nalloc      = N;
+      initialized = 0;
+    }
+
+  if ( !initialized )
+    {
+      // first call: forces and bins for everybody
+      for ( size_t i = 0; i < N; i++ )
+	active_indexes[i] = i;
+      active_forces( P, N, active_indexes, N, engine, theta, rc );
+
+      memset( bin_count, 0, sizeof(bin_count) );
+      for ( size_t i = 0; i < N; i++ ) {
+	bin[i] = timestep_bin( P, i, dtmax, eta );
+	bin_count[bin[i]]++;
+	maxbin_seen = ( bin[i] > maxbin_seen ? bin[i] : maxbin_seen ); }
+      initialized = 1;
+    }
+
+  // all the particles are synchronized: first half-kick
+  //
+  for ( size_t i = 0; i < N; i++ )
+    kick( P, i, 0.5 * DTI(bin[i]) * dt_unit );
+
+  long ti = 0;
+  while ( ti < TIMEBASE )
+    {
+      // the sub-step is set by the finest occupied bin, and must not
+      // jump over the next boundary of the current time
+      //
+      int maxb = MAX_BIN;
+      while ( (maxb > 0) && (bin_count[maxb] == 0) )
+	maxb--;
+      long dti = DTI(maxb);
+      if ( (ti > 0) && ((ti & -ti) < dti) )
+	dti = ti & -ti;
+
+      // drift
+      //
+      const double dt = dti * dt_unit;
+     #pragma omp parallel for schedule(static)
+      for ( size_t i = 0; i < N; i++ )
+	{
+	  PX(P,i) += PVX(P,i) * dt;
+	  PY(P,i) += PVY(P,i) * dt;
+	  PZ(P,i) += PVZ(P,i) * dt;
+	}
+      ti += dti;
+      nsubsteps++;
+
+      // active particles: those in bins whose step divides ti
+      //
+      int    bmin    = MAX_BIN - __builtin_ctzl( ti );
+      size_t Nactive = 0;
+      if ( bmin < 0 )
+	bmin = 0;
+      for ( size_t i = 0; i < N; i++ )
+	if ( bin[i] >= bmin )
+	  active_indexes[Nactive++] = i;
+
+      active_forces( P, N, active_indexes, Nactive, engine, theta, rc );
+
+      // second half-kick, new bin, first half-kick
+      //
+      for ( size_t k = 0; k < Nactive; k++ )
+	{
+	  size_t i = active_indexes[k];
+	  kick( P, i, 0.5 * DTI(bin[i]) * dt_unit );
+
+	  int newb = timestep_bin( P, i, dtmax, eta );
+	  // a larger step is allowed only if ti is one of its boundaries
+	  while ( (newb < bin[i]) && (ti % DTI(newb) != 0) )
+	    newb++;
+	  bin_count[bin[i]]--;
+	  bin_count[newb]++;
+	  bin[i] = newb;
+	  maxbin_seen = ( newb > maxbin_seen ? newb : maxbin_seen );
+
+	  if ( ti < TIMEBASE )
+	    kick( P, i, 0.5 * DTI(bin[i]) * dt_unit );
+	}
+    }
+
+  nbigsteps++;
+}
+
+
+void leapfrog_report ( const size_t N )
+{
+  if ( nbigsteps == 0 )
+    return;
+
+  printf("Block timesteps: %llu sub-steps in %llu steps, %g force updates per particle and step\n"
+	 "                 (a single global timestep would need %llu per particle and step)\n",
+	 nsubsteps, nbigsteps, (double)nforce_updates / N / nbigsteps,
+	 1ULL << maxbin_seen );
+  printf("Bin occupation at the end:\n");
+  for ( int b = 0; b <= MAX_BIN; b++ )
+    if ( bin_count[b] > 0 )
+      printf("   bin %2d  dt = dt_max/2^%-2d : %llu particles\n",
+	     b, b, (unsigned long long)bin_count[b] );
+}
+
+
+/**
+ * @brief Follows a reordering of the particles (see sfc_reorder()).
+ */
+void leapfrog_permute ( const size_t * restrict perm, const size_t N )
+{
+  if ( (bin == NULL) || (Nalloc != N) )
+    return;
+
+  // active_indexes is rebuilt at every sub-step, use it as scratch
+  int *old = (int*)active_indexes;
+  memcpy( old, bin, N * sizeof(int) );
+  for ( size_t k = 0; k < N; k++ )
+    bin[k] = old[perm[k]];
+}
+
+
+void leapfrog_release ( void )
+{
+  free ( bin );
+  free ( active_indexes );
+  bin            = NULL;
+  active_indexes = NULL;
+  Nalloc         = 0;
+  initialized    = 0;
+}
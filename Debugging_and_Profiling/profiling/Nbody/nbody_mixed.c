@@ -0,0 +1,198 @@
+/**
+ * @file nbody_mixed.c
+ * @brief Mixed-precision direct summation: float interactions, double sums.
+ *
+ * The pair loop is where all the flops and all the bandwidth go; in float
+ * it moves half the bytes and fits twice as many lanes in a vector. What
+ * float can not afford is the accumulation: the force on a particle is the
+ * sum of N terms of very different size, and the positions are integrated
+ * over many steps. So:
+ *
+ *  - at every call the positions are shifted to the centre of the bounding
+ *    box (in double) and stored in float, together with the masses, in four
+ *    packed float arrays; the shift keeps the coordinates small, so that the
+ *    float differences dx keep most of the bits they would have in double;
+ *  - the relative positions, the distances and the inverse distances are
+ *    computed in float;
+ *  - the contributions to the acceleration of particle i are summed in
+ *    float only over tiles of TILE j-particles, and the partial sums of the
+ *    tiles are accumulated in double; the force G m a is computed in double.
+ *
+ * The Newton's third law saving is not used here: updating f[j] in double
+ * from float terms costs a conversion and a scattered read-modify-write for
+ * every pair, which takes more than what it saves. Without it the loop on j
+ * is a pure float reduction, that vectorizes fully, and the loop on i is
+ * free of write conflicts and runs in parallel.
+ *
+ * The integration stays in double, as everything else. How much the
+ * precision loss costs over a long run can be checked with the energy and
+ * momentum monitor (-m, see nbody_diag.c).
+ *
+ * Every thread reads the whole float copy at every i, so on a multi-socket
+ * node the copy is remote for all the threads but those of one socket. With
+ * replicate there is one copy per NUMA node (see nbody_numa.c), written by
+ * the first thread of that node so that its pages are local, and every
+ * thread reads the copy of its own node.
+ */
+
+#include "Nbody.h"
+
+#define TILE 256            // j-particles summed in float before going to double
+#define MAX_REPLICAS 64     // NUMA nodes
+
+
+static float  *hot[MAX_REPLICAS] = { NULL };   // x[N], y[N], z[N], mass[N], per node
+static size_t  Nalloc = 0;
+static int     nalloc = 0;
+
+
+static void allocate ( const size_t N, const int nrep )
+{
+  if ( (Nalloc >= N) && (nalloc >= nrep) )
+    return;
+
+  mixed_release();
+  // the pages are placed when first written, not here
+  for ( int r = 0; r < nrep; r++ )
+    {
+      hot[r] = (float*)aligned_alloc( 64, (4 * N * sizeof(float) + 63) / 64 * 64 );
+      if ( hot[r] == NULL ) {
+	fprintf( stderr, "unable to allocate the buffers for the mixed-precision kernel\n" );
+	exit( 1 ); }
+    }
+  Nalloc = N;
+  nalloc = nrep;
+}
+
+
+static void fill ( particle_t * restrict P, const size_t N, float * restrict h,
+		   const double cx, const double cy, const double cz )
+{
+  for ( size_t i = 0; i < N; i++ )
+    {
+      h[i]       = (float)( PX(P,i) - cx );
+      h[N + i]   = (float)( PY(P,i) - cy );
+      h[2*N + i] = (float)( PZ(P,i) - cz );
+      h[3*N + i] = (float)PM(P,i);
+    }
+}
+
+
+/**
+ * @brief Acceleration (divided by G) exerted on the point (x,y,z) by the N
+ * particles in xf, yf, zf, mf.
+ * Compile with -fno-math-errno: sqrtf() is always called on a positive
+ * number here, but otherwise the compiler has to keep the errno semantics
+ * and does not vectorize the loop.
+ */
+static inline void acceleration ( const float * restrict xf, const float * restrict yf,
+			   const float * restrict zf, const float * restrict mf,
+			   const size_t N, const float x, const float y, const float z,
+			   double a[3] )
+{
+  const float eps = (float)epsilon_sq;
+
+  double ax = 0;
+  double ay = 0;
+  double az = 0;
+
+  for ( size_t j0 = 0; j0 < N; j0 += TILE )
+    {
+      const size_t j1 = ( j0 + TILE < N ? j0 + TILE : N );
+      float sx = 0;
+      float sy = 0;
+      float sz = 0;
+
+      // the self-interaction has dx = dy = dz = 0 and gives no force
+     #pragma omp simd reduction(+:sx,sy,sz)
+      for ( size_t j = j0; j < j1; j++ )
+	{
+	  float dx = xf[j] - x;
+	  float dy = yf[j] - y;
+	  float dz = zf[j] - z;
+
+	  float dist_sq  = dx * dx + dy * dy + dz * dz + eps;
+	  float inv_dist = 1.0f / sqrtf(dist_sq);
+	  float w        = mf[j] * inv_dist * inv_dist * inv_dist;
+
+	  sx += w * dx;
+	  sy += w * dy;
+	  sz += w * dz;
+	}
+
+      ax += sx;
+      ay += sy;
+      az += sz;
+    }
+
+  a[0] = ax;
+  a[1] = ay;
+  a[2] = az;
+}
+
+
+/**
+ * @brief Direct summation in mixed precision; with replicate, the float
+ * copy of positions and masses is replicated on every NUMA node.
+ */
+void compute_forces_mixed ( particle_t * restrict P, const size_t N, const int replicate )
+{
+  if ( N == 0 )
+    return;
+
+  int nrep = ( replicate ? numa_nodes() : 1 );
+  nrep = ( nrep < MAX_REPLICAS ? nrep : MAX_REPLICAS );
+  allocate( N, nrep );
+
+  // centre of the bounding box
+  //
+  double min[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  double max[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  for ( size_t i = 1; i < N; i++ )
+    {
+      min[0] = fmin( min[0], PX(P,i) ); max[0] = fmax( max[0], PX(P,i) );
+      min[1] = fmin( min[1], PY(P,i) ); max[1] = fmax( max[1], PY(P,i) );
+      min[2] = fmin( min[2], PZ(P,i) ); max[2] = fmax( max[2], PZ(P,i) );
+    }
+  const double cx = 0.5 * (min[0] + max[0]);
+  const double cy = 0.5 * (min[1] + max[1]);
+  const double cz = 0.5 * (min[2] + max[2]);
+
+  if ( nrep == 1 )
+    fill( P, N, hot[0], cx, cy, cz );
+  else
+   #pragma omp parallel
+    if ( numa_is_leader() )
+      fill( P, N, hot[numa_my_node()], cx, cy, cz );
+
+ #pragma omp parallel
+  {
+    const float * restrict h  = hot[ nrep > 1 ? numa_my_node() : 0 ];
+    const float * restrict xf = h;
+    const float * restrict yf = h + N;
+    const float * restrict zf = h + 2*N;
+    const float * restrict mf = h + 3*N;
+
+   #pragma omp for schedule(static)
+    for ( size_t i = 0; i < N; i++ )
+      {
+	double a[3];
+	acceleration( xf, yf, zf, mf, N, xf[i], yf[i], zf[i], a );
+
+	const double mG = PM(P,i)*G;
+	PFX(P,i) = mG * a[0];
+	PFY(P,i) = mG * a[1];
+	PFZ(P,i) = mG * a[2];
+      }
+  }
+}
+
+
+void mixed_release ( void )
+{
+  for ( int r = 0; r < nalloc; r++ )
+    free ( hot[r] );
+  memset( hot, 0, sizeof(hot) );
+  Nalloc = 0;
+  nalloc = 0;
+}
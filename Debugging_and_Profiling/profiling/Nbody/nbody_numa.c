@@ -0,0 +1,202 @@
+/**
+ * @file nbody_numa.c
+ * @brief Thread pinning and NUMA placement.
+ *
+ * On a multi-socket node a memory page lives on the NUMA node of the thread
+ * that first touched it, and a thread reading pages of another node pays
+ * the lower bandwidth of the inter-socket link. Two things are needed for
+ * the placement to be under control:
+ *
+ *  - the threads must not migrate: numa_setup() pins every OpenMP thread to
+ *    one core of those the process is allowed to run on, and records the
+ *    core and the NUMA node it runs on;
+ *  - every page must be first touched by the thread that will use it:
+ *    initialize_particles() writes all the fields in a static loop, with no
+ *    memset() after the allocation, so that thread t owns the same slice of
+ *    every array (of all ten, for SoA) in the initialization and in all the
+ *    static loops that follow.
+ *
+ * The arrays that all the threads read in full, the positions and masses of
+ * the j-particles, can not be local to every thread. They are small and
+ * read-only during the force computation, so they can be replicated, one
+ * copy per NUMA node, each written by a thread of that node: this is what
+ * the mixed-precision engine does with -n (see nbody_mixed.c).
+ *
+ * get_core() and pin_to_core() are those of fcycles.c in
+ * Single_Core_Optimization/exercises/cache/ex_1__memory_mountain.
+ */
+
+#if !defined(_GNU_SOURCE) && defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "Nbody.h"
+
+#include <sched.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+
+static int  nthreads    = 1;
+static int  nnodes      = 1;
+static int *thread_core = NULL;
+static int *thread_node = NULL;     // the NUMA node, as an index in [0, nnodes)
+static int *node_leader = NULL;     // the first thread running on every node
+static int  pinned      = 0;
+
+
+static inline int get_core ( unsigned int * node )
+{
+ #if defined (__linux__)
+  if ( node != NULL )
+    {
+      unsigned int cpu;
+      getcpu( &cpu, node );
+      return cpu;
+    }
+  else
+    return sched_getcpu();
+ #else
+
+  return -1;
+ #endif
+}
+
+
+static inline int pin_to_core( unsigned int coreid )
+{
+ #if defined(__linux__)
+  cpu_set_t cpuset;
+  CPU_ZERO ( &cpuset );
+  CPU_SET  ( coreid, &cpuset );
+
+  // remind: this call fails if the affinity mask in the kernel is
+  // larger than 1024 bytes
+  //
+  return sched_setaffinity ( 0, sizeof(cpu_set_t), &cpuset );
+ #else
+  return -1;
+ #endif
+}
+
+
+static inline int thread_id ( void )
+{
+ #if defined(_OPENMP)
+  return omp_get_thread_num();
+ #else
+  return 0;
+ #endif
+}
+
+
+/**
+ * @brief Pins the threads, if pin, and finds the core and the NUMA node of
+ * every thread. To be called before the particles are allocated.
+ * @return the number of NUMA nodes the threads run on
+ */
+int numa_setup ( const int pin )
+{
+ #if defined(_OPENMP)
+  nthreads = omp_get_max_threads();
+ #endif
+  numa_release();
+  thread_core = (int*)malloc( 3 * nthreads * sizeof(int) );
+  if ( thread_core == NULL ) {
+    fprintf( stderr, "unable to allocate the thread map\n" );
+    exit( 1 ); }
+  thread_node = thread_core + nthreads;
+  node_leader = thread_node + nthreads;
+
+  // the cores we are allowed to run on, in order
+  int ncores = 0;
+ #if defined(__linux__)
+  int       cores[CPU_SETSIZE];
+  cpu_set_t allowed;
+  if ( sched_getaffinity( 0, sizeof(allowed), &allowed ) == 0 )
+    for ( int c = 0; c < CPU_SETSIZE; c++ )
+      if ( CPU_ISSET( c, &allowed ) )
+	cores[ncores++] = c;
+ #endif
+
+  int failed = 0;
+  unsigned int nodeid[nthreads];
+
+ #pragma omp parallel num_threads(nthreads) reduction(+:failed)
+  {
+    int me = thread_id();
+   #if defined(__linux__)
+    if ( pin && (ncores > 0) )
+      failed += ( pin_to_core( cores[me % ncores] ) != 0 );
+   #endif
+    nodeid[me] = 0;
+    thread_core[me] = get_core( &nodeid[me] );
+  }
+  pinned = ( pin && (ncores > 0) && (failed == 0) );
+  if ( pin && !pinned )
+    fprintf( stderr, "unable to pin the threads to the cores\n" );
+
+  // number the nodes densely, in order of appearance
+  nnodes = 0;
+  for ( int t = 0; t < nthreads; t++ )
+    {
+      int n = 0;
+      while ( (n < t) && (nodeid[n] != nodeid[t]) )
+	n++;
+      if ( n < t )
+	thread_node[t] = thread_node[n];
+      else {
+	thread_node[t] = nnodes;
+	node_leader[nnodes++] = t; }
+    }
+
+  return nnodes;
+}
+
+
+int numa_nodes ( void )
+{
+  return nnodes;
+}
+
+
+/**
+ * @brief The NUMA node of the calling thread, as an index in [0, nodes).
+ */
+int numa_my_node ( void )
+{
+  return ( thread_node != NULL ? thread_node[thread_id() % nthreads] : 0 );
+}
+
+
+/**
+ * @brief Whether the calling thread is the first of its NUMA node.
+ */
+int numa_is_leader ( void )
+{
+  int me = thread_id() % nthreads;
+  return ( thread_node == NULL ? me == 0 : node_leader[thread_node[me]] == me );
+}
+
+
+void numa_report ( void )
+{
+  if ( thread_core == NULL )
+    return;
+  printf ( " \t %d threads on %d NUMA node%s, %s:",
+	   nthreads, nnodes, (nnodes > 1 ? "s" : ""), (pinned ? "pinned" : "not pinned") );
+  for ( int t = 0; t < nthreads; t++ )
+    printf ( " %d@%d", thread_core[t], thread_node[t] );
+  printf ( " (core@node)\n" );
+}
+
+
+void numa_release ( void )
+{
+  free ( thread_core );
+  thread_core = NULL;
+  thread_node = NULL;
+  node_leader = NULL;
+  nnodes      = 1;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file nbody_omp.c
+ * @brief Multi-threaded direct summation that keeps the Newton's third law saving.
+ *
+ * The serial kernel visits only the pairs j > i and updates both particles,
+ * so a plain "omp parallel for" on i would have different threads writing
+ * the same f[j]. Here the particles are split in nb blocks and the work is
+ * organized in tiles (a,b), a <= b. The tiles are scheduled as in a
+ * round-robin tournament (the "circle method"): in every round each block
+ * appears in exactly one tile, so all the tiles of a round can be processed
+ * concurrently with no write conflicts and no atomics. There are nb-1 such
+ * rounds for the off-diagonal tiles, plus one round for the nb diagonal
+ * tiles (a,a), which are independent of each other.
+ *
+ * No extra memory is needed, contrary to per-thread force accumulators
+ * (nthreads * 3N doubles) that become a problem at large N.
+ *
+ * compute_forces_omp_potential() also sums the potential energy in the
+ * same pass, for the diagnostics (see nbody_diag.c).
+ */
+
+#include "Nbody.h"
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+#define BLOCKS_PER_THREAD 4     // nb ~ 2*BLOCKS_PER_THREAD*nthreads, for load balance
+#define MIN_BLOCK_SIZE    64    // don't make the tiles too small
+
+
+/**
+ * @brief Interaction of block [ia0,ia1) with block [ib0,ib1), both updated.
+ * If the two blocks coincide only the pairs j > i are visited.
+ * @return the potential energy of the pairs, if want_U
+ */
+static inline double tile ( particle_t * restrict P,
+			    const size_t ia0, const size_t ia1,
+			    const size_t ib0, const size_t ib1, const int want_U )
+{
+  const int diagonal = (ia0 == ib0);
+  double    U        = 0;
+
+  for ( size_t i = ia0; i < ia1; i++ )
+    {
+      const double x  = PX(P,i);
+      const double y  = PY(P,i);
+      const double z  = PZ(P,i);
+      const double mG = PM(P,i)*G;
+
+      double fx = 0;
+      double fy = 0;
+      double fz = 0;
+      double u  = 0;
+
+      for ( size_t j = (diagonal ? i+1 : ib0); j < ib1; j++ )
+	{
+	  double dx = PX(P,j) - x;
+	  double dy = PY(P,j) - y;
+	  double dz = PZ(P,j) - z;
+
+	  double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
+	  double inv_dist = 1.0 / sqrt(dist_sq);
+	  double inv_dist_cubed = inv_dist * inv_dist * inv_dist;
+	  double force_mag = mG * PM(P,j) * inv_dist_cubed;
+
+	  double _fx = force_mag * dx;
+	  double _fy = force_mag * dy;
+	  double _fz = force_mag * dz;
+
+	  fx += _fx;
+	  fy += _fy;
+	  fz += _fz;
+	  if ( want_U )
+	    u += PM(P,j) * inv_dist;
+
+	  PFX(P,j) -= _fx;
+	  PFY(P,j) -= _fy;
+	  PFZ(P,j) -= _fz;
+	}
+
+      PFX(P,i) += fx;
+      PFY(P,i) += fy;
+      PFZ(P,i) += fz;
+      U -= mG * u;
+    }
+
+  return U;
+}
+
+
+/**
+ * @brief Multi-threaded direct summation, conflict-free tiled schedule.
+ * @return the potential energy, if want_U
+ */
+static double forces_omp ( particle_t * restrict P, const size_t N, const int want_U )
+{
+  double U        = 0;
+  int    nthreads = 1;
+ #if defined(_OPENMP)
+  nthreads = omp_get_max_threads();
+ #endif
+
+  // number of blocks: even, so that every round is made of nb/2 tiles
+  //
+  size_t nb = 2 * BLOCKS_PER_THREAD * (size_t)nthreads;
+  while ( (nb > 2) && (N / nb < MIN_BLOCK_SIZE) )
+    nb -= 2;
+  const size_t bsize = (N + nb - 1) / nb;
+
+ #define BSTART(b) ( (size_t)(b) * bsize < N ? (size_t)(b) * bsize : N )
+ #define BEND(b)   ( (size_t)((b)+1) * bsize < N ? (size_t)((b)+1) * bsize : N )
+
+ #pragma omp parallel
+  {
+   #pragma omp for schedule(static)
+    for ( size_t i = 0; i < N; i++ )
+      PFX(P,i) = PFY(P,i) = PFZ(P,i) = 0.0;
+
+    // diagonal tiles
+    //
+   #pragma omp for schedule(dynamic, 1) reduction(+:U)
+    for ( size_t a = 0; a < nb; a++ )
+      U += tile( P, BSTART(a), BEND(a), BSTART(a), BEND(a), want_U );
+
+    // off-diagonal tiles, round-robin rounds:
+    // block nb-1 is kept fixed and the others rotate around it.
+    // The implicit barrier at the end of each omp for separates the rounds.
+    //
+    for ( size_t r = 0; r < nb-1; r++ )
+     #pragma omp for schedule(dynamic, 1) reduction(+:U)
+      for ( size_t k = 0; k < nb/2; k++ )
+	{
+	  size_t a = ( k == 0 ? nb-1 : (r + k) % (nb-1) );
+	  size_t b = (r + nb-1 - k) % (nb-1);
+	  if ( a > b ) { size_t t = a; a = b; b = t; }
+	  U += tile( P, BSTART(a), BEND(a), BSTART(b), BEND(b), want_U );
+	}
+  }
+
+ #undef BSTART
+ #undef BEND
+
+  return U;
+}
+
+
+void compute_forces_omp ( particle_t * restrict P, const size_t N )
+{
+  forces_omp( P, N, 0 );
+}
+
+
+/**
+ * @brief The forces, as compute_forces_omp(), and the potential energy,
+ * which is returned.
+ */
+double compute_forces_omp_potential ( particle_t * restrict P, const size_t N )
+{
+  return forces_omp( P, N, 1 );
+}
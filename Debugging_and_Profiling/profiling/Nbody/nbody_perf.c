@@ -0,0 +1,154 @@
+/**
+ * @file nbody_perf.c
+ * @brief Hardware counters from perf_event_open(), when PAPI is not there.
+ *
+ * The same four events as in mypapi.h, in the same order: instructions,
+ * cycles, L1 data cache misses and last-level cache misses (the generic
+ * perf events have no L2 misses, which is what PAPI counts instead).
+ *
+ * Every thread of the OpenMP team opens its own events, so that the counts
+ * are those of the whole team and not only of the master thread; the
+ * master enables, disables and reads all of them, which perf allows from
+ * any thread of the process. The events are opened disabled and count in
+ * user space only, which needs a perf_event_paranoid of 2 at most.
+ *
+ * mypapi.h maps its PAPI_* macros on these functions when compiled
+ * without -DUSE_PAPI, so that Nbody.c uses the counters the same way.
+ */
+
+#if defined(__linux__)
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "Nbody.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+
+static int  nthreads = 0;
+static int *fds      = NULL;      // [nthreads][PERF_EVENTS_NUM]
+static int  ok       = 0;
+
+
+static int open_event ( const unsigned int type, const unsigned long long config )
+{
+  struct perf_event_attr attr;
+  memset( &attr, 0, sizeof(attr) );
+  attr.size           = sizeof(attr);
+  attr.type           = type;
+  attr.config         = config;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  // this thread, any cpu, no group
+  return (int)syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+
+/**
+ * @brief Opens the counters for every thread of the team.
+ * @return 1 if all of them could be opened, 0 otherwise (and then none is)
+ */
+int perf_counters_open ( void )
+{
+  const unsigned int type[PERF_EVENTS_NUM] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+  const unsigned long long config[PERF_EVENTS_NUM] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_LL  | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+
+  perf_counters_close();
+  nthreads = 1;
+ #if defined(_OPENMP)
+  nthreads = omp_get_max_threads();
+ #endif
+  fds = (int*)malloc( nthreads * PERF_EVENTS_NUM * sizeof(int) );
+  if ( fds == NULL )
+    return 0;
+  for ( int k = 0; k < nthreads * PERF_EVENTS_NUM; k++ )
+    fds[k] = -1;
+
+  int failed = 0;
+ #pragma omp parallel num_threads(nthreads) reduction(+:failed)
+  {
+    int me = 0;
+   #if defined(_OPENMP)
+    me = omp_get_thread_num();
+   #endif
+    for ( int e = 0; e < PERF_EVENTS_NUM; e++ )
+      {
+	fds[me*PERF_EVENTS_NUM + e] = open_event( type[e], config[e] );
+	failed += ( fds[me*PERF_EVENTS_NUM + e] < 0 );
+      }
+  }
+
+  ok = ( failed == 0 );
+  if ( !ok )
+    perf_counters_close();
+  return ok;
+}
+
+
+int perf_counters_ok ( void )
+{
+  return ok;
+}
+
+
+void perf_counters_start ( void )
+{
+  if ( !ok )
+    return;
+  for ( int k = 0; k < nthreads * PERF_EVENTS_NUM; k++ )
+    {
+      ioctl( fds[k], PERF_EVENT_IOC_RESET, 0 );
+      ioctl( fds[k], PERF_EVENT_IOC_ENABLE, 0 );
+    }
+}
+
+
+/**
+ * @brief Stops the counters and stores in values their sums over the team.
+ */
+void perf_counters_stop ( unsigned long long values[PERF_EVENTS_NUM] )
+{
+  for ( int e = 0; e < PERF_EVENTS_NUM; e++ )
+    values[e] = 0;
+  if ( !ok )
+    return;
+
+  for ( int k = 0; k < nthreads * PERF_EVENTS_NUM; k++ )
+    ioctl( fds[k], PERF_EVENT_IOC_DISABLE, 0 );
+
+  for ( int k = 0; k < nthreads * PERF_EVENTS_NUM; k++ )
+    {
+      unsigned long long count;
+      if ( read( fds[k], &count, sizeof(count) ) == (ssize_t)sizeof(count) )
+	values[k % PERF_EVENTS_NUM] += count;
+    }
+}
+
+
+void perf_counters_close ( void )
+{
+  if ( fds != NULL )
+    for ( int k = 0; k < nthreads * PERF_EVENTS_NUM; k++ )
+      if ( fds[k] >= 0 )
+	close( fds[k] );
+  free ( fds );
+  fds = NULL;
+  ok  = 0;
+}
+
+#endif
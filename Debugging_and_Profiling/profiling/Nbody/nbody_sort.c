@@ -0,0 +1,228 @@
+/**
+ * @file nbody_sort.c
+ * @brief Reordering of the particles along a Morton (Z-order) space-filling curve.
+ *
+ * The particles are created at random positions in storage order, so that
+ * particles close in space are far apart in memory: every access pattern
+ * driven by the space (the tree build and walk, the neighbour searches)
+ * jumps all over the arrays. Sorting them along a space-filling curve makes
+ * neighbours in space likely neighbours in memory.
+ *
+ * The key of a particle is obtained by normalizing its position to the
+ * bounding box, quantizing each coordinate on 21 bits and interleaving the
+ * bits of x, y and z in a 63-bit integer. The (key, index) pairs are sorted
+ * with an LSD radix sort and the resulting permutation is applied to all the
+ * ten fields of the particles, so that a particle is always carried as a
+ * whole. The particles move slowly, so the order degrades slowly and the
+ * sort needs to be repeated only every so many steps.
+ *
+ * The original index of every particle is tracked, so that a given particle
+ * can always be found (see sfc_find()).
+ */
+
+#include "Nbody.h"
+
+#define KEY_BITS    21              // bits per dimension
+#define RADIX_BITS  16
+#define RADIX       (1 << RADIX_BITS)
+
+typedef unsigned long long sfckey_t;
+
+
+static size_t   *ids    = NULL;     // ids[i]: original index of the particle in i
+static size_t   *perm   = NULL;     // perm[k]: where the new k-th particle was
+static size_t   *perm2  = NULL;
+static sfckey_t *keys   = NULL;
+static sfckey_t *keys2  = NULL;
+static void     *tmp    = NULL;
+static size_t    Nalloc = 0;
+
+
+/**
+ * @brief Spreads the lower 21 bits of v so that there are 2 zeros
+ * between each of them.
+ */
+static inline sfckey_t spread_bits ( sfckey_t v )
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x001f00000000ffffULL;
+  v = (v | v << 16) & 0x001f0000ff0000ffULL;
+  v = (v | v <<  8) & 0x100f00f00f00f00fULL;
+  v = (v | v <<  4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v <<  2) & 0x1249249249249249ULL;
+  return v;
+}
+
+
+static inline sfckey_t morton_key ( const double x, const double y, const double z,
+				  const double min[3], const double scale )
+{
+  sfckey_t ix = (sfckey_t)( (x - min[0]) * scale );
+  sfckey_t iy = (sfckey_t)( (y - min[1]) * scale );
+  sfckey_t iz = (sfckey_t)( (z - min[2]) * scale );
+  return spread_bits( ix ) | (spread_bits( iy ) << 1) | (spread_bits( iz ) << 2);
+}
+
+
+static void allocate ( const size_t N )
+{
+  if ( Nalloc == N )
+    return;
+
+  sfc_release();
+  ids   = (size_t*)malloc( N * sizeof(size_t) );
+  perm  = (size_t*)malloc( 2 * N * sizeof(size_t) );
+  keys  = (sfckey_t*)malloc( 2 * N * sizeof(sfckey_t) );
+  tmp   = malloc( N * PARTICLE_BYTES );
+  if ( (ids == NULL) || (perm == NULL) || (keys == NULL) || (tmp == NULL) ) {
+    fprintf( stderr, "unable to allocate the buffers for the sorting\n" );
+    exit( 1 ); }
+  perm2 = perm + N;
+  keys2 = keys + N;
+
+  for ( size_t i = 0; i < N; i++ )
+    ids[i] = i;
+  Nalloc = N;
+}
+
+
+/**
+ * @brief Sorts the particles along the Morton curve.
+ * @return the permutation that has been applied: the particle now in
+ *         position k was in position perm[k]. It is valid until the next call.
+ */
+const size_t *sfc_reorder ( particle_t * restrict P, const size_t N )
+{
+  if ( N == 0 )
+    return NULL;
+
+  allocate( N );
+
+  // bounding box and keys
+  //
+  double min[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  double max[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  for ( size_t i = 1; i < N; i++ )
+    {
+      min[0] = fmin( min[0], PX(P,i) ); max[0] = fmax( max[0], PX(P,i) );
+      min[1] = fmin( min[1], PY(P,i) ); max[1] = fmax( max[1], PY(P,i) );
+      min[2] = fmin( min[2], PZ(P,i) ); max[2] = fmax( max[2], PZ(P,i) );
+    }
+  double side  = fmax( max[0]-min[0], fmax( max[1]-min[1], max[2]-min[2] ) );
+  double scale = ( side > 0 ? ((1 << KEY_BITS) - 1) / side : 0 );
+
+  for ( size_t i = 0; i < N; i++ )
+    {
+      keys[i] = morton_key( PX(P,i), PY(P,i), PZ(P,i), min, scale );
+      perm[i] = i;
+    }
+
+  // LSD radix sort of the (key, index) pairs
+  //
+  {
+    static size_t count[RADIX];
+    sfckey_t *ksrc = keys, *kdst = keys2;
+    size_t *psrc = perm, *pdst = perm2;
+
+    for ( int shift = 0; shift < 3*KEY_BITS; shift += RADIX_BITS )
+      {
+	memset( count, 0, sizeof(count) );
+	for ( size_t i = 0; i < N; i++ )
+	  count[(ksrc[i] >> shift) & (RADIX-1)]++;
+
+	size_t sum = 0;
+	for ( int d = 0; d < RADIX; d++ ) {
+	  size_t c = count[d];
+	  count[d] = sum;
+	  sum += c; }
+
+	for ( size_t i = 0; i < N; i++ )
+	  {
+	    size_t pos = count[(ksrc[i] >> shift) & (RADIX-1)]++;
+	    kdst[pos] = ksrc[i];
+	    pdst[pos] = psrc[i];
+	  }
+
+	sfckey_t *kt = ksrc; ksrc = kdst; kdst = kt;
+	size_t *pt = psrc; psrc = pdst; pdst = pt;
+      }
+
+    if ( psrc != perm )
+      memcpy( perm, psrc, N * sizeof(size_t) );
+  }
+
+  // apply the permutation to all the fields, and to the ids
+  //
+ #ifdef USE_SOA
+  double *fields[10] = { P->x, P->y, P->z, P->vx, P->vy, P->vz,
+			 P->mass, P->fx, P->fy, P->fz };
+  double *buffer = (double*)tmp;
+  for ( int f = 0; f < 10; f++ )
+    {
+      for ( size_t k = 0; k < N; k++ )
+	buffer[k] = fields[f][perm[k]];
+      memcpy( fields[f], buffer, N * sizeof(double) );
+    }
+ #elif defined(USE_AOSOA) || defined(USE_SPLIT)
+  // field by field, the fields of a particle are not contiguous
+  double *buffer = (double*)tmp;
+ #define PERMUTE_FIELD(f) {						\
+    for ( size_t k = 0; k < N; k++ )					\
+      buffer[k] = PFIELD(P,perm[k],f);					\
+    for ( size_t k = 0; k < N; k++ )					\
+      PFIELD(P,k,f) = buffer[k]; }
+  PERMUTE_FIELD(x);  PERMUTE_FIELD(y);  PERMUTE_FIELD(z);
+  PERMUTE_FIELD(vx); PERMUTE_FIELD(vy); PERMUTE_FIELD(vz);
+  PERMUTE_FIELD(mass);
+  PERMUTE_FIELD(fx); PERMUTE_FIELD(fy); PERMUTE_FIELD(fz);
+ #undef PERMUTE_FIELD
+ #else
+  particle_t *buffer = (particle_t*)tmp;
+  for ( size_t k = 0; k < N; k++ )
+    buffer[k] = P[perm[k]];
+  memcpy( P, buffer, N * sizeof(particle_t) );
+ #endif
+
+  for ( size_t k = 0; k < N; k++ )
+    perm2[k] = ids[perm[k]];
+  memcpy( ids, perm2, N * sizeof(size_t) );
+
+  return perm;
+}
+
+
+/**
+ * @brief Where the particle that was originally the id-th is now.
+ */
+size_t sfc_find ( const size_t id )
+{
+  if ( ids == NULL )
+    return id;
+  for ( size_t i = 0; i < Nalloc; i++ )
+    if ( ids[i] == id )
+      return i;
+  return id;
+}
+
+
+/**
+ * @brief The original index of the particle in each position, NULL if the
+ * particles have never been reordered.
+ */
+const size_t *sfc_ids ( void )
+{
+  return ids;
+}
+
+
+void sfc_release ( void )
+{
+  free ( ids );
+  free ( perm );
+  free ( keys );
+  free ( tmp );
+  ids = perm = perm2 = NULL;
+  keys = keys2 = NULL;
+  tmp = NULL;
+  Nalloc = 0;
+}
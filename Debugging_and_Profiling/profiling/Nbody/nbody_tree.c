@@ -0,0 +1,344 @@
+/**
+ * @file nbody_tree.c
+ * @brief Barnes-Hut force engine for the N-body toy simulator.
+ *
+ * At every step an octree is built over the current particle positions.
+ * The particles are not moved: the tree works on a permutation array
+ * idx[], and every node owns a contiguous range idx[start .. start+count).
+ * Each node stores its monopole (total mass and centre of mass), which is
+ * used in place of the particles it contains when the node is seen from
+ * far enough:
+ *
+ *       (node side) / distance < theta
+ *
+ * theta = 0 opens every node and reproduces the direct summation (at a
+ * higher cost); theta ~ 0.5 - 0.7 is the usual production choice.
+ *
+ * Contrary to the direct summation, the tree walk writes only the force of
+ * the particle it is walking for, so there are no symmetric updates.
+ */
+
+#include "Nbody.h"
+
+#define LEAF_SIZE   8       // max number of particles in a leaf
+#define MAX_DEPTH   48      // stop splitting below this depth (coincident particles)
+#define STACK_SIZE  (8*MAX_DEPTH + 8)
+
+typedef struct {
+  double center[3];         // geometric centre of the cube
+  double half;              // half side of the cube
+  double com[3];            // centre of mass
+  double mass;              // total mass
+  size_t start, count;      // range of idx[] covered by the node
+  int    first;             // index of the first child, children are contiguous
+  int    nchild;            // 0 for leaves
+} node_t;
+
+
+typedef struct {
+  node_t *nodes;
+  int     nnodes;
+  int     maxnodes;
+  size_t *idx;
+  size_t *tmp;
+  size_t  N;
+} tree_t;
+
+static tree_t tree = { NULL, 0, 0, NULL, NULL, 0 };
+
+
+
+static int new_nodes ( int n )
+// reserve n contiguous nodes, return the index of the first one
+{
+  if ( tree.nnodes + n > tree.maxnodes )
+    {
+      int newmax = (tree.maxnodes > 0 ? tree.maxnodes * 2 : 1024);
+      while ( newmax < tree.nnodes + n )
+	newmax *= 2;
+      node_t *new = (node_t*)realloc( tree.nodes, newmax * sizeof(node_t) );
+      if ( new == NULL ) {
+	fprintf( stderr, "unable to allocate %d tree nodes\n", newmax );
+	exit( 1 ); }
+      tree.nodes    = new;
+      tree.maxnodes = newmax;
+    }
+  int first = tree.nnodes;
+  tree.nnodes += n;
+  return first;
+}
+
+
+static void build_node ( particle_t * restrict P, int n, int depth )
+{
+  // note: tree.nodes may be reallocated by the recursion, hence
+  //       the nodes are always accessed through their index
+
+  size_t start = tree.nodes[n].start;
+  size_t count = tree.nodes[n].count;
+
+  if ( (count <= LEAF_SIZE) || (depth >= MAX_DEPTH) )
+    {
+      // leaf: compute the monopole directly from the particles
+      double m = 0, cx = 0, cy = 0, cz = 0;
+      for ( size_t k = start; k < start+count; k++ )
+	{
+	  size_t j = tree.idx[k];
+	  double mj = PM(P,j);
+	  m  += mj;
+	  cx += mj * PX(P,j);
+	  cy += mj * PY(P,j);
+	  cz += mj * PZ(P,j);
+	}
+      node_t *node = &tree.nodes[n];
+      node->mass   = m;
+      node->com[0] = cx / m;
+      node->com[1] = cy / m;
+      node->com[2] = cz / m;
+      node->first  = -1;
+      node->nchild = 0;
+      return;
+    }
+
+  // partition the particles in the 8 octants (counting sort on idx[])
+  //
+  double c[3] = { tree.nodes[n].center[0], tree.nodes[n].center[1], tree.nodes[n].center[2] };
+  double half = tree.nodes[n].half;
+
+  size_t  octcount[8] = {0};
+  size_t  octstart[8];
+  size_t *restrict idx = tree.idx + start;
+  size_t *restrict tmp = tree.tmp + start;
+
+  for ( size_t k = 0; k < count; k++ )
+    {
+      size_t j = idx[k];
+      int oct = (PX(P,j) >= c[0]) | ((PY(P,j) >= c[1]) << 1) | ((PZ(P,j) >= c[2]) << 2);
+      octcount[oct]++;
+    }
+
+  octstart[0] = 0;
+  for ( int o = 1; o < 8; o++ )
+    octstart[o] = octstart[o-1] + octcount[o-1];
+
+  size_t pos[8];
+  memcpy( pos, octstart, sizeof(pos) );
+  for ( size_t k = 0; k < count; k++ )
+    {
+      size_t j = idx[k];
+      int oct = (PX(P,j) >= c[0]) | ((PY(P,j) >= c[1]) << 1) | ((PZ(P,j) >= c[2]) << 2);
+      tmp[pos[oct]++] = j;
+    }
+  memcpy( idx, tmp, count * sizeof(size_t) );
+
+  // create the non-empty children
+  //
+  int nchild = 0;
+  for ( int o = 0; o < 8; o++ )
+    nchild += (octcount[o] > 0);
+
+  int first = new_nodes( nchild );
+  tree.nodes[n].first  = first;
+  tree.nodes[n].nchild = nchild;
+
+  double h = half * 0.5;
+  int    k = first;
+  for ( int o = 0; o < 8; o++ )
+    {
+      if ( octcount[o] == 0 )
+	continue;
+      node_t *child    = &tree.nodes[k++];
+      child->center[0] = c[0] + ( (o & 1) ? h : -h );
+      child->center[1] = c[1] + ( (o & 2) ? h : -h );
+      child->center[2] = c[2] + ( (o & 4) ? h : -h );
+      child->half      = h;
+      child->start     = start + octstart[o];
+      child->count     = octcount[o];
+    }
+
+  for ( int ch = first; ch < first + nchild; ch++ )
+    build_node( P, ch, depth+1 );
+
+  // monopole of the node from the monopoles of the children
+  //
+  double m = 0, cx = 0, cy = 0, cz = 0;
+  for ( int ch = first; ch < first + nchild; ch++ )
+    {
+      node_t *child = &tree.nodes[ch];
+      m  += child->mass;
+      cx += child->mass * child->com[0];
+      cy += child->mass * child->com[1];
+      cz += child->mass * child->com[2];
+    }
+  node_t *node = &tree.nodes[n];
+  node->mass   = m;
+  node->com[0] = cx / m;
+  node->com[1] = cy / m;
+  node->com[2] = cz / m;
+
+  return;
+}
+
+
+/**
+ * @brief Builds the octree over the current positions.
+ */
+static void build_tree ( particle_t * restrict P, const size_t N )
+{
+  if ( tree.N != N )
+    {
+      free ( tree.idx );
+      tree.idx = (size_t*)malloc( 2 * N * sizeof(size_t) );
+      if ( tree.idx == NULL ) {
+	fprintf( stderr, "unable to allocate the tree index\n" );
+	exit( 1 ); }
+      tree.tmp = tree.idx + N;
+      tree.N   = N;
+    }
+
+  for ( size_t i = 0; i < N; i++ )
+    tree.idx[i] = i;
+
+  // bounding cube
+  //
+  double min[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  double max[3] = { PX(P,0), PY(P,0), PZ(P,0) };
+  for ( size_t i = 1; i < N; i++ )
+    {
+      min[0] = fmin( min[0], PX(P,i) ); max[0] = fmax( max[0], PX(P,i) );
+      min[1] = fmin( min[1], PY(P,i) ); max[1] = fmax( max[1], PY(P,i) );
+      min[2] = fmin( min[2], PZ(P,i) ); max[2] = fmax( max[2], PZ(P,i) );
+    }
+
+  double side = fmax( max[0]-min[0], fmax( max[1]-min[1], max[2]-min[2] ) );
+  side *= 1.0001;     // make sure that particles on the upper faces are inside
+
+  tree.nnodes = 0;
+  int root = new_nodes( 1 );
+  node_t *r = &tree.nodes[root];
+  r->center[0] = 0.5 * (min[0] + max[0]);
+  r->center[1] = 0.5 * (min[1] + max[1]);
+  r->center[2] = 0.5 * (min[2] + max[2]);
+  r->half      = 0.5 * side;
+  r->start     = 0;
+  r->count     = N;
+
+  build_node( P, root, 0 );
+}
+
+
+/**
+ * @brief Walks the tree to compute the force on particle i.
+ */
+static inline void walk_tree ( particle_t * restrict P, const size_t i, const double theta2 )
+{
+  const double x  = PX(P,i);
+  const double y  = PY(P,i);
+  const double z  = PZ(P,i);
+  const double mG = PM(P,i)*G;
+
+  double fx = 0;
+  double fy = 0;
+  double fz = 0;
+
+  int stack[STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+
+  while ( top > 0 )
+    {
+      const node_t *node = &tree.nodes[stack[--top]];
+
+      double dx = node->com[0] - x;
+      double dy = node->com[1] - y;
+      double dz = node->com[2] - z;
+      double dist_sq = dx * dx + dy * dy + dz * dz;
+      double side    = 2.0 * node->half;
+
+      // a node that contains the particle is always opened
+      int inside = ( fabs(x - node->center[0]) <= node->half ) &&
+	( fabs(y - node->center[1]) <= node->half ) &&
+	( fabs(z - node->center[2]) <= node->half );
+
+      if ( !inside && (side * side < theta2 * dist_sq) )
+	{
+	  // far enough: use the monopole
+	  dist_sq += epsilon_sq;
+	  double inv_dist = 1.0 / sqrt(dist_sq);
+	  double force_mag = mG * node->mass * inv_dist * inv_dist * inv_dist;
+	  fx += force_mag * dx;
+	  fy += force_mag * dy;
+	  fz += force_mag * dz;
+	}
+      else if ( node->nchild == 0 )
+	{
+	  // leaf: direct summation over its particles
+	  for ( size_t k = node->start; k < node->start + node->count; k++ )
+	    {
+	      size_t j = tree.idx[k];
+	      if ( j == i )
+		continue;
+	      double dx = PX(P,j) - x;
+	      double dy = PY(P,j) - y;
+	      double dz = PZ(P,j) - z;
+	      double dist_sq = dx * dx + dy * dy + dz * dz + epsilon_sq;
+	      double inv_dist = 1.0 / sqrt(dist_sq);
+	      double force_mag = mG * PM(P,j) * inv_dist * inv_dist * inv_dist;
+	      fx += force_mag * dx;
+	      fy += force_mag * dy;
+	      fz += force_mag * dz;
+	    }
+	}
+      else
+	for ( int ch = node->first; ch < node->first + node->nchild; ch++ )
+	  stack[top++] = ch;
+    }
+
+  PFX(P,i) = fx;
+  PFY(P,i) = fy;
+  PFZ(P,i) = fz;
+}
+
+
+/**
+ * @brief Barnes-Hut force calculation, O(N log N).
+ * @param theta the opening angle
+ */
+void compute_forces_tree ( particle_t * restrict P, const size_t N, const double theta )
+{
+  compute_forces_tree_active( P, N, theta, NULL, N );
+}
+
+
+/**
+ * @brief Barnes-Hut forces on a subset of the particles only.
+ * The tree is always built over all the particles.
+ * @param active_indexes the particles to update, NULL for all of them
+ */
+void compute_forces_tree_active ( particle_t * restrict P, const size_t N, const double theta,
+				  const size_t * restrict active_indexes, const size_t Nactive )
+{
+  if ( N == 0 )
+    return;
+
+  build_tree( P, N );
+
+  // the walks are independent, and write only the force of their own particle
+  const double theta2 = theta * theta;
+ #pragma omp parallel for schedule(dynamic, 64)
+  for ( size_t k = 0; k < Nactive; k++ )
+    walk_tree( P, (active_indexes != NULL ? active_indexes[k] : k), theta2 );
+}
+
+
+void tree_release ( void )
+{
+  free ( tree.nodes );
+  free ( tree.idx );
+  tree.nodes    = NULL;
+  tree.idx      = NULL;
+  tree.tmp      = NULL;
+  tree.nnodes   = 0;
+  tree.maxnodes = 0;
+  tree.N        = 0;
+}